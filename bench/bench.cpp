@@ -0,0 +1,238 @@
+//   Copyright 2023 sotpider - caozhanhao
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+// End-to-end benchmark: runs the whole Pipeline against local mock source,
+// download and WordPress servers, and reports throughput, peak RSS and the
+// latency of every stage.
+//   sotpider_bench [--users=4] [--pages=5] [--posts=20] [--media=1] [--media_size=65536]
+//                  [--latency=0] [--bandwidth=0] [--errors=0]
+//                  [--fetch_concurrency=4] [--fetch_workers=2] [--download_workers=4]
+//                  [--upload_workers=2] [--batch_size=0] [--relay_buffer=0]
+// latency is in ms, bandwidth in bytes/s per connection, errors the share of 503 responses.
+#include "sotpider.hpp"
+#include "mock_server.hpp"
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <map>
+#include <atomic>
+#include <chrono>
+#include <sys/resource.h>
+
+namespace
+{
+  struct NullBuffer : std::streambuf
+  {
+    int overflow(int c) override { return c; }
+  };
+  
+  std::string query_value(const std::string &target, const std::string &key)
+  {
+    auto pos = target.find(key + "=");
+    if (pos == std::string::npos) return "";
+    pos += key.size() + 1;
+    return target.substr(pos, target.find('&', pos) - pos);
+  }
+  
+  // /v2/user/<id>/?after=N&page=N
+  sp::bench::Reply source(const sp::bench::Request &req, std::size_t pages, std::size_t posts, std::size_t media)
+  {
+    const std::string prefix = "/v2/user/";
+    if (req.target.compare(0, prefix.size(), prefix) != 0) return {404, {}, ""};
+    auto id = req.target.substr(prefix.size(), req.target.find('/', prefix.size()) - prefix.size());
+    auto page = std::stoul(query_value(req.target, "page"));
+    if (page == 0 || page > pages) return {404, {}, "{\"data\":[]}"};
+    std::string body = "{\"data\":[";
+    for (std::size_t i = 0; i < posts; ++i)
+    {
+      auto post_id = std::to_string(1000000000 - (page - 1) * posts - i);
+      if (i != 0) body += ',';
+      body += "{\"id\":\"" + post_id + "\",\"user\":{\"name\":\"" + id + "\"},"
+              "\"text\":\"Post " + post_id + " of " + id + " \\u2728 lorem ipsum dolor sit amet\","
+              "\"tagEntities\":[{\"text\":\"tag" + std::to_string(i % 7) + "\"},{\"text\":\"bench\"}],"
+              "\"mediaEntities\":[";
+      for (std::size_t m = 0; m < media; ++m)
+      {
+        if (m != 0) body += ',';
+        body += "{\"mediaURL\":\"https://media.invalid/" + id + "/" + post_id + "-" + std::to_string(m) + ".jpg\"}";
+      }
+      body += "]}";
+    }
+    body += "]}";
+    return {200, {"Content-Type: application/json"}, std::move(body)};
+  }
+  
+  // /wp/v2/tags, /wp/v2/media, /wp/v2/posts and /batch/v1
+  sp::bench::Reply wordpress(const sp::bench::Request &req, std::atomic<int> &next_id, std::atomic<std::size_t> &created)
+  {
+    auto route = query_value(req.target, "rest_route");
+    auto json = [](std::string body) { return sp::bench::Reply{201, {"Content-Type: application/json"}, std::move(body)}; };
+    if (route == "/wp/v2/tags")
+    {
+      if (req.method == "GET") return {200, {"X-WP-TotalPages: 1", "Content-Type: application/json"}, "[]"};
+      return json("{\"id\":" + std::to_string(next_id++) + "}");
+    }
+    if (route == "/wp/v2/media")
+    {
+      auto id = std::to_string(next_id++);
+      return json("{\"id\":" + id + ",\"description\":{\"rendered\":\"<p><img src=\\\"/media/" + id + ".jpg\\\"></p>\"}}");
+    }
+    if (route == "/wp/v2/posts")
+    {
+      ++created;
+      return json("{\"id\":" + std::to_string(next_id++) + "}");
+    }
+    if (route == "/batch/v1")
+    {
+      std::size_t n = 0;
+      for (auto pos = req.body.find("\"method\""); pos != std::string::npos; pos = req.body.find("\"method\"", pos + 1))
+        ++n;
+      std::string body = "{\"responses\":[";
+      for (std::size_t i = 0; i < n; ++i)
+      {
+        if (i != 0) body += ',';
+        body += "{\"status\":201,\"body\":{\"id\":" + std::to_string(next_id++) + "}}";
+      }
+      body += "]}";
+      created += n;
+      return {207, {"Content-Type: application/json"}, std::move(body)};
+    }
+    return {404, {}, "{\"code\":\"rest_no_route\"}"};
+  }
+  
+  void print_stages()
+  {
+    std::map<std::string, sp::Metrics::Summary> stages;
+    for (auto &s: sp::Metrics::get().histograms("sotpider_http_request_seconds"))
+    {
+      std::string stage;
+      for (auto &[k, v]: s.labels)
+        if (k == "stage") stage = v;
+      auto it = stages.find(stage);
+      if (it == stages.end())
+      {
+        stages.emplace(stage, s);
+        continue;
+      }
+      it->second.count += s.count;
+      it->second.sum += s.sum;
+      for (std::size_t i = 0; i < s.buckets.size(); ++i)
+        it->second.buckets[i] += s.buckets[i];
+    }
+    std::cout << std::left << std::setw(16) << "stage" << std::right << std::setw(10) << "requests"
+              << std::setw(12) << "mean ms" << std::setw(12) << "p50 ms" << std::setw(12) << "p99 ms" << "\n";
+    for (auto &[stage, s]: stages)
+    {
+      std::cout << std::left << std::setw(16) << stage << std::right << std::setw(10) << s.count
+                << std::setw(12) << (s.count == 0 ? 0 : s.sum / static_cast<double>(s.count) * 1000)
+                << std::setw(12) << s.quantile(0.5) * 1000 << std::setw(12) << s.quantile(0.99) * 1000 << "\n";
+    }
+    std::cout << "(p50/p99 are the upper bounds of their histogram buckets)" << std::endl;
+  }
+}
+
+int main(int argc, char **argv)
+{
+  std::map<std::string, std::string> args{
+      {"users", "4"}, {"pages", "5"}, {"posts", "20"}, {"media", "1"}, {"media_size", "65536"},
+      {"latency", "0"}, {"bandwidth", "0"}, {"errors", "0"},
+      {"fetch_concurrency", "4"}, {"fetch_workers", "2"}, {"download_workers", "4"},
+      {"upload_workers", "2"}, {"batch_size", "0"}, {"relay_buffer", "0"}
+  };
+  for (int i = 1; i < argc; ++i)
+  {
+    std::string arg = argv[i];
+    auto eq = arg.find('=');
+    if (arg.compare(0, 2, "--") != 0 || eq == std::string::npos || args.count(arg.substr(2, eq - 2)) == 0)
+    {
+      std::cerr << "Unknown argument '" << arg << "'." << std::endl;
+      return 1;
+    }
+    args[arg.substr(2, eq - 2)] = arg.substr(eq + 1);
+  }
+  auto num = [&args](const std::string &key) { return std::stoul(args[key]); };
+  
+  sp::bench::Faults faults;
+  faults.latency = std::chrono::milliseconds(num("latency"));
+  faults.bandwidth = num("bandwidth");
+  faults.error_rate = std::stod(args["errors"]);
+  
+  std::atomic<int> next_id = 1;
+  std::atomic<std::size_t> created = 0;
+  std::string media(num("media_size"), 'x');
+  for (std::size_t i = 0; i < media.size(); ++i)
+    media[i] = static_cast<char>(i * 2654435761u >> 24);
+  sp::bench::MockServer source_server(
+      [pages = num("pages"), posts = num("posts"), n = num("media")](auto &req) { return source(req, pages, posts, n); },
+      faults);
+  sp::bench::MockServer download_server(
+      [&media](auto &) { return sp::bench::Reply{200, {"Content-Type: image/jpeg"}, media}; }, faults);
+  sp::bench::MockServer wordpress_server(
+      [&next_id, &created](auto &req) { return wordpress(req, next_id, created); }, faults);
+  
+  sp::PipelineConfig config;
+  config.from_server = source_server.url();
+  config.download_server = download_server.url();
+  config.to_server = wordpress_server.url();
+  config.timeout = 60;
+  config.fetch_concurrency = num("fetch_concurrency");
+  config.fetch_workers = num("fetch_workers");
+  config.download_workers = num("download_workers");
+  config.upload_workers = num("upload_workers");
+  config.queue_size = 32;
+  config.relay_buffer = num("relay_buffer");
+  config.batch_size = num("batch_size");
+  config.batch_interval = 50;
+  config.journal = "";
+  config.tags_cache = "";
+  config.media_index = "";
+  config.incremental = false;
+  config.max_attempts = 10;
+  config.backoff_base = 10;
+  config.backoff_cap = 1000;
+  
+  std::vector<std::string> ids;
+  for (std::size_t i = 0; i < num("users"); ++i)
+    ids.emplace_back("user" + std::to_string(i));
+  
+  NullBuffer null;
+  auto *out = std::cout.rdbuf(&null);// the pipeline reports every post
+  auto start = std::chrono::steady_clock::now();
+  {
+    sp::Pipeline pipeline{config};
+    pipeline.run(ids);
+  }
+  auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  std::cout.rdbuf(out);
+  
+  std::size_t bytes = 0;
+  std::size_t errors = 0;
+  for (auto s: {&source_server, &download_server, &wordpress_server})
+  {
+    bytes += s->sent() + s->received();
+    errors += s->injected_errors();
+  }
+  rusage usage{};
+  getrusage(RUSAGE_SELF, &usage);
+  
+  std::cout << std::fixed << std::setprecision(2)
+            << num("users") << " users x " << num("pages") << " pages x " << num("posts") << " posts: "
+            << created << " posts in " << seconds << " s\n"
+            << "posts/s:     " << static_cast<double>(created) / seconds << "\n"
+            << "MiB/s:       " << static_cast<double>(bytes) / seconds / (1024 * 1024) << "\n"
+            << "peak RSS:    " << static_cast<double>(usage.ru_maxrss) / 1024 << " MiB\n"
+            << "503s:        " << errors << "\n";
+  print_stages();
+  return created == num("users") * num("pages") * num("posts") ? 0 : 1;
+}
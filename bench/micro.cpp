@@ -0,0 +1,220 @@
+//   Copyright 2023 sotpider - caozhanhao
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+// Microbenchmarks of the CPU work done per post, on the pages in bench/corpus:
+// parsing a page, escaping the media urls, printing a post and building the
+// WordPress payloads. Reports ns/post and heap allocations/post.
+//   sotpider_micro [corpus directory] [ms per benchmark]
+#include "sotpider.hpp"
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <memory>
+#include <functional>
+#include <new>
+
+#ifndef SOTPIDER_CORPUS_DIR
+#define SOTPIDER_CORPUS_DIR "bench/corpus"
+#endif
+
+namespace
+{
+  std::atomic<std::size_t> allocations = 0;
+  std::atomic<std::size_t> allocated = 0;
+}
+
+void *operator new(std::size_t size)
+{
+  ++allocations;
+  allocated += size;
+  if (auto p = std::malloc(size == 0 ? 1 : size)) return p;
+  throw std::bad_alloc();
+}
+
+void *operator new[](std::size_t size) { return operator new(size); }
+
+void operator delete(void *p) noexcept { std::free(p); }
+
+void operator delete[](void *p) noexcept { std::free(p); }
+
+void operator delete(void *p, std::size_t) noexcept { std::free(p); }
+
+void operator delete[](void *p, std::size_t) noexcept { std::free(p); }
+
+namespace
+{
+  struct NullBuffer : std::streambuf
+  {
+    int overflow(int c) override { return c; }
+  };
+  
+  struct Result
+  {
+    double ns_per_post;
+    double allocations_per_post;
+    double bytes_per_post;
+  };
+  
+  // Runs step, which handles `posts` posts, until `budget` has passed.
+  // prepare runs before every step and is neither timed nor counted.
+  Result measure(std::size_t posts, std::chrono::milliseconds budget,
+                 const std::function<void()> &prepare, const std::function<void()> &step)
+  {
+    std::size_t runs = 0;
+    std::chrono::nanoseconds spent{0};
+    std::size_t allocs = 0, bytes = 0;
+    while (runs < 3 || spent < budget)
+    {
+      prepare();
+      auto a = allocations.load(), b = allocated.load();
+      auto start = std::chrono::steady_clock::now();
+      step();
+      spent += std::chrono::steady_clock::now() - start;
+      allocs += allocations - a;
+      bytes += allocated - b;
+      ++runs;
+    }
+    auto n = static_cast<double>(runs * std::max<std::size_t>(posts, 1));
+    return {static_cast<double>(spent.count()) / n, static_cast<double>(allocs) / n, static_cast<double>(bytes) / n};
+  }
+  
+  std::string read_file(const std::string &path)
+  {
+    std::ifstream in(path, std::ios_base::binary);
+    sp::sp_assert(in.is_open(), "Open '" + path + "' failed.");
+    std::ostringstream ss;
+    ss << in.rdbuf();
+    return ss.str();
+  }
+  
+  // Repeats the posts of page until it holds about `times` as many.
+  std::string tile(const std::string &page, std::size_t times)
+  {
+    auto beg = page.find('[', page.find("\"data\""));
+    auto end = page.rfind(']');
+    auto posts = page.substr(beg + 1, end - beg - 1);
+    std::string ret = page.substr(0, beg + 1);
+    for (std::size_t i = 0; i < times; ++i)
+    {
+      if (i != 0) ret += ',';
+      ret += posts;
+    }
+    ret += page.substr(end);
+    return ret;
+  }
+}
+
+int main(int argc, char **argv)
+{
+  std::string dir = argc > 1 ? argv[1] : SOTPIDER_CORPUS_DIR;
+  std::chrono::milliseconds budget{argc > 2 ? std::stoi(argv[2]) : 300};
+  std::vector<std::pair<std::string, std::string>> corpus;
+  for (auto name: {"small", "emoji", "media"})
+    corpus.emplace_back(name, read_file(dir + "/" + name + ".json"));
+  corpus.emplace_back("huge", tile(corpus[2].second, 100));// 2000 media-heavy posts
+  
+  sp::PostGetter getter{"https://source.invalid", "https://download.invalid"};
+  NullBuffer null;
+  
+  std::cout << std::left << std::setw(10) << "corpus" << std::setw(10) << "bench" << std::right
+            << std::setw(8) << "posts" << std::setw(12) << "ns/post" << std::setw(14) << "allocs/post"
+            << std::setw(14) << "bytes/post" << "\n" << std::fixed << std::setprecision(1);
+  auto report = [](const std::string &corpus, const std::string &bench, std::size_t posts, const Result &r)
+  {
+    std::cout << std::left << std::setw(10) << corpus << std::setw(10) << bench << std::right
+              << std::setw(8) << posts << std::setw(12) << r.ns_per_post << std::setw(14) << r.allocations_per_post
+              << std::setw(14) << r.bytes_per_post << std::endl;
+  };
+  
+  for (auto &[name, page]: corpus)
+  {
+    // parse: the in-situ parse, field extraction and download url building of fetch_video()
+    std::shared_ptr<std::string> body;
+    std::vector<sp::Post> posts;
+    getter.parse_posts("bench", std::make_shared<std::string>(page), posts);
+    auto n = posts.size();
+    report(name, "parse", n, measure(n, budget, [&]
+    {
+      posts.clear();
+      posts.reserve(n);
+      body = std::make_shared<std::string>(page);
+    }, [&] { getter.parse_posts("bench", body, posts); }));
+    
+    // escape: only the curl_easy_escape() of every media url
+    std::vector<std::string> urls;
+    for (auto &p: posts)
+    {
+      for (auto &[type, url]: p.get_media())
+      {
+        int size = 0;
+        char *raw = curl_easy_unescape(nullptr, url.c_str(), static_cast<int>(url.size()), &size);
+        urls.emplace_back(raw, static_cast<std::size_t>(size));
+        curl_free(raw);
+      }
+    }
+    report(name, "escape", n, measure(n, budget, [] {}, [&]
+    {
+      for (auto &u: urls)
+        getter.escape(u);
+    }));
+    
+    // print: Post::print() into a discarded stream
+    auto *out = std::cout.rdbuf(&null);
+    auto printed = measure(n, budget, [] {}, [&]
+    {
+      for (auto &p: posts)
+        p.print();
+    });
+    std::cout.rdbuf(out);
+    report(name, "print", n, printed);
+    
+    // form: what Uploader::publish() sends for every post, without sending it
+    const std::vector<std::pair<int, std::string>> none,
+        medias{{42, "<p><img src=\"/wp-content/uploads/0.jpg\"></p>"}};
+    report(name, "form", n, measure(n, budget, [] {}, [&]
+    {
+      for (auto &p: posts)
+      {
+        auto form = sp::Uploader::compose(p, p.get_media().empty() ? none : medias);
+        form.tags = {1, 2, 3};
+        auto http_form = sp::Uploader::make_form(form);
+      }
+    }));
+    
+    // batch: the /batch/v1 bodies of PostBatcher, up to 25 posts each
+    std::vector<sp::Uploader::PostForm> forms;
+    for (auto &p: posts)
+    {
+      forms.emplace_back(sp::Uploader::compose(p, medias));
+      forms.back().tags = {1, 2, 3};
+    }
+    report(name, "batch", n, measure(n, budget, [] {}, [&]
+    {
+      for (std::size_t i = 0; i < forms.size(); i += 25)
+      {
+        std::vector<const sp::Uploader::PostForm *> batch;
+        for (std::size_t j = i; j < std::min(i + 25, forms.size()); ++j)
+          batch.emplace_back(&forms[j]);
+        auto body = sp::Uploader::make_batch(batch);
+      }
+    }));
+  }
+  return 0;
+}
@@ -0,0 +1,282 @@
+//   Copyright 2023 sotpider - caozhanhao
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+#ifndef SOTPIDER_BENCH_MOCK_SERVER_HPP
+#define SOTPIDER_BENCH_MOCK_SERVER_HPP
+#include "error.hpp"
+#include <string>
+#include <string_view>
+#include <vector>
+#include <map>
+#include <set>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <cctype>
+#include <functional>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+namespace sp::bench
+{
+  // How a MockServer misbehaves.
+  struct Faults
+  {
+    std::chrono::milliseconds latency{0};// before every response
+    std::size_t bandwidth = 0;// bytes per second per connection, 0: no limit
+    double error_rate = 0;// share of responses replaced by a 503
+  };
+  
+  struct Request
+  {
+    std::string method;
+    std::string target;// path and query
+    std::map<std::string, std::string> headers;// lowercase names
+    std::string body;
+  };
+  
+  struct Reply
+  {
+    int status = 200;
+    std::vector<std::string> headers;
+    std::string body;
+  };
+  
+  // A small HTTP/1.1 server on 127.0.0.1 with keep-alive, one thread per connection.
+  // Handles Content-Length and chunked request bodies and Expect: 100-continue,
+  // which is all libcurl sends.
+  class MockServer
+  {
+  public:
+    using Handler = std::function<Reply(const Request &)>;
+  private:
+    Handler handler;
+    Faults faults;
+    int listener;
+    std::uint16_t port;
+    std::thread acceptor;
+    std::mutex mtx;
+    std::set<int> clients;
+    std::vector<std::thread> workers;
+    std::atomic<bool> stopping;
+    std::atomic<std::size_t> requests;
+    std::atomic<std::size_t> bytes_in;
+    std::atomic<std::size_t> bytes_out;
+    std::atomic<std::size_t> errors;
+  public:
+    MockServer(Handler handler_, Faults faults_)
+        : handler(std::move(handler_)), faults(faults_), listener(-1), port(0), stopping(false),
+          requests(0), bytes_in(0), bytes_out(0), errors(0)
+    {
+      listener = ::socket(AF_INET, SOCK_STREAM, 0);
+      sp_assert(listener != -1, "socket() failed.");
+      int yes = 1;
+      ::setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+      sockaddr_in addr{};
+      addr.sin_family = AF_INET;
+      addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+      addr.sin_port = 0;
+      sp_assert(::bind(listener, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == 0, "bind() failed.");
+      sp_assert(::listen(listener, 128) == 0, "listen() failed.");
+      socklen_t len = sizeof(addr);
+      ::getsockname(listener, reinterpret_cast<sockaddr *>(&addr), &len);
+      port = ntohs(addr.sin_port);
+      acceptor = std::thread([this] { accept_loop(); });
+    }
+    
+    MockServer(const MockServer &) = delete;
+    
+    ~MockServer()
+    {
+      stopping = true;
+      ::shutdown(listener, SHUT_RDWR);
+      ::close(listener);
+      acceptor.join();
+      {
+        std::lock_guard l(mtx);
+        for (auto fd: clients)
+          ::shutdown(fd, SHUT_RDWR);
+      }
+      for (auto &t: workers)
+        t.join();
+    }
+    
+    [[nodiscard]] std::string url() const { return "http://127.0.0.1:" + std::to_string(port); }
+    
+    [[nodiscard]] std::size_t request_count() const { return requests; }
+    
+    [[nodiscard]] std::size_t received() const { return bytes_in; }
+    
+    [[nodiscard]] std::size_t sent() const { return bytes_out; }
+    
+    [[nodiscard]] std::size_t injected_errors() const { return errors; }
+  
+  private:
+    void accept_loop()
+    {
+      while (!stopping)
+      {
+        int fd = ::accept(listener, nullptr, nullptr);
+        if (fd == -1) continue;
+        int yes = 1;
+        ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+        std::lock_guard l(mtx);
+        if (stopping)
+        {
+          ::close(fd);
+          break;
+        }
+        clients.insert(fd);
+        workers.emplace_back([this, fd] { serve(fd); });
+      }
+    }
+    
+    void serve(int fd)
+    {
+      std::mt19937_64 rng{static_cast<std::uint64_t>(fd) * 7919 + port};
+      std::uniform_real_distribution<double> chance(0, 1);
+      std::string buffer;
+      Request req;
+      while (!stopping && read_request(fd, buffer, req))
+      {
+        ++requests;
+        Reply reply;
+        if (faults.error_rate > 0 && chance(rng) < faults.error_rate)
+        {
+          ++errors;
+          reply.status = 503;
+          reply.headers.emplace_back("Retry-After: 0");
+          reply.body = "{\"code\":\"mock_unavailable\"}";
+        }
+        else
+          reply = handler(req);
+        if (faults.latency.count() != 0)
+          std::this_thread::sleep_for(faults.latency);
+        if (!write_reply(fd, req, reply)) break;
+        auto conn = req.headers.find("connection");
+        if (conn != req.headers.end() && conn->second == "close") break;
+      }
+      std::lock_guard l(mtx);
+      clients.erase(fd);
+      ::close(fd);
+    }
+    
+    // buffer keeps what was read past the end of the previous request.
+    bool read_request(int fd, std::string &buffer, Request &req)
+    {
+      std::size_t end;
+      while ((end = buffer.find("\r\n\r\n")) == std::string::npos)
+        if (!fill(fd, buffer)) return false;
+      std::string_view head(buffer.data(), end);
+      req = Request{};
+      auto line_end = head.find("\r\n");
+      auto request_line = head.substr(0, line_end);
+      auto sp1 = request_line.find(' ');
+      auto sp2 = request_line.rfind(' ');
+      if (sp1 == std::string_view::npos || sp2 == sp1) return false;
+      req.method = request_line.substr(0, sp1);
+      req.target = request_line.substr(sp1 + 1, sp2 - sp1 - 1);
+      while (line_end != std::string_view::npos)
+      {
+        auto next = head.find("\r\n", line_end + 2);
+        auto line = head.substr(line_end + 2, next == std::string_view::npos ? std::string_view::npos
+                                                                             : next - line_end - 2);
+        line_end = next;
+        auto colon = line.find(':');
+        if (colon == std::string_view::npos) continue;
+        std::string name(line.substr(0, colon));
+        std::transform(name.begin(), name.end(), name.begin(), [](unsigned char c) { return std::tolower(c); });
+        auto value = line.substr(colon + 1);
+        value.remove_prefix(std::min(value.find_first_not_of(' '), value.size()));
+        req.headers[name] = value;
+      }
+      buffer.erase(0, end + 4);
+      if (auto expect = req.headers.find("expect"); expect != req.headers.end())
+        send_all(fd, "HTTP/1.1 100 Continue\r\n\r\n");
+      if (auto te = req.headers.find("transfer-encoding"); te != req.headers.end() && te->second == "chunked")
+      {
+        while (true)
+        {
+          std::size_t size_end;
+          while ((size_end = buffer.find("\r\n")) == std::string::npos)
+            if (!fill(fd, buffer)) return false;
+          auto size = std::stoul(buffer.substr(0, size_end), nullptr, 16);
+          while (buffer.size() < size_end + 2 + size + 2)
+            if (!fill(fd, buffer)) return false;
+          req.body.append(buffer, size_end + 2, size);
+          buffer.erase(0, size_end + 2 + size + 2);
+          if (size == 0) break;
+        }
+      }
+      else if (auto cl = req.headers.find("content-length"); cl != req.headers.end())
+      {
+        auto size = std::stoul(cl->second);
+        while (buffer.size() < size)
+          if (!fill(fd, buffer)) return false;
+        req.body = buffer.substr(0, size);
+        buffer.erase(0, size);
+      }
+      return true;
+    }
+    
+    bool fill(int fd, std::string &buffer)
+    {
+      char chunk[64 * 1024];
+      auto n = ::recv(fd, chunk, sizeof(chunk), 0);
+      if (n <= 0) return false;
+      bytes_in += static_cast<std::size_t>(n);
+      buffer.append(chunk, static_cast<std::size_t>(n));
+      return true;
+    }
+    
+    bool write_reply(int fd, const Request &req, const Reply &reply)
+    {
+      std::string head = "HTTP/1.1 " + std::to_string(reply.status) + (reply.status < 400 ? " OK" : " Error") + "\r\n";
+      for (auto &h: reply.headers)
+        head += h + "\r\n";
+      head += "Content-Length: " + std::to_string(reply.body.size()) + "\r\n\r\n";
+      if (!send_all(fd, head)) return false;
+      if (req.method == "HEAD") return true;
+      if (faults.bandwidth == 0)
+        return send_all(fd, reply.body);
+      // 10 slices a second
+      auto slice = std::max<std::size_t>(faults.bandwidth / 10, 1);
+      for (std::size_t pos = 0; pos < reply.body.size(); pos += slice)
+      {
+        auto start = std::chrono::steady_clock::now();
+        if (!send_all(fd, std::string_view(reply.body).substr(pos, slice))) return false;
+        std::this_thread::sleep_until(start + std::chrono::duration<double>(
+            static_cast<double>(std::min(slice, reply.body.size() - pos)) / static_cast<double>(faults.bandwidth)));
+      }
+      return true;
+    }
+    
+    bool send_all(int fd, std::string_view data)
+    {
+      while (!data.empty())
+      {
+        auto n = ::send(fd, data.data(), data.size(), MSG_NOSIGNAL);
+        if (n <= 0) return false;
+        bytes_out += static_cast<std::size_t>(n);
+        data.remove_prefix(static_cast<std::size_t>(n));
+      }
+      return true;
+    }
+  };
+}
+#endif
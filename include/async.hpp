@@ -0,0 +1,530 @@
+//   Copyright 2023 sotpider - caozhanhao
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+#ifndef SOTPIDER_ASYNC_HPP
+#define SOTPIDER_ASYNC_HPP
+#include "error.hpp"
+#include "http.hpp"
+#include "retry.hpp"
+#include "curl/curl.h"
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <utility>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <limits>
+#include <iostream>
+#include <cerrno>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+namespace sp
+{
+  template<typename T = void>
+  class Task;
+  
+  namespace detail
+  {
+    // Resumes whoever awaited the finished Task.
+    struct FinalAwaiter
+    {
+      bool await_ready() noexcept { return false; }
+      
+      template<typename P>
+      std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept
+      {
+        auto continuation = h.promise().continuation;
+        return continuation ? continuation : std::noop_coroutine();
+      }
+      
+      void await_resume() noexcept {}
+    };
+    
+    struct PromiseBase
+    {
+      std::coroutine_handle<> continuation;
+      std::exception_ptr error;
+      
+      std::suspend_always initial_suspend() noexcept { return {}; }
+      
+      FinalAwaiter final_suspend() noexcept { return {}; }
+      
+      void unhandled_exception() { error = std::current_exception(); }
+    };
+    
+    template<typename T>
+    struct Promise : PromiseBase
+    {
+      std::optional<T> value;
+      
+      Task<T> get_return_object();
+      
+      template<typename U>
+      void return_value(U &&v) { value.emplace(std::forward<U>(v)); }
+      
+      T result()
+      {
+        if (error) std::rethrow_exception(error);
+        return std::move(*value);
+      }
+    };
+    
+    template<>
+    struct Promise<void> : PromiseBase
+    {
+      Task<void> get_return_object();
+      
+      void return_void() {}
+      
+      void result()
+      {
+        if (error) std::rethrow_exception(error);
+      }
+    };
+    
+    // Starts at once and frees itself at the end, for spawn() and sync_wait().
+    struct Detached
+    {
+      struct promise_type
+      {
+        Detached get_return_object() { return {}; }
+        
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        
+        std::suspend_never final_suspend() noexcept { return {}; }
+        
+        void return_void() {}
+        
+        void unhandled_exception() { std::terminate(); }
+      };
+    };
+  }
+  
+  // A lazily started coroutine. It runs when it is co_awaited, and resumes the
+  // awaiting coroutine when it returns, rethrowing its exception if it threw.
+  template<typename T>
+  class Task
+  {
+  public:
+    using promise_type = detail::Promise<T>;
+  private:
+    std::coroutine_handle<promise_type> handle;
+  public:
+    explicit Task(std::coroutine_handle<promise_type> handle_) : handle(handle_) {}
+    
+    Task(Task &&t) noexcept: handle(std::exchange(t.handle, nullptr)) {}
+    
+    Task(const Task &) = delete;
+    
+    ~Task()
+    {
+      if (handle) handle.destroy();
+    }
+    
+    auto operator co_await() &
+    {
+      return Awaiter<true>{handle};
+    }
+    
+    auto operator co_await() &&
+    {
+      return Awaiter<true>{handle};
+    }
+    
+    // Waits for the task to finish without taking its result, see get().
+    auto when_done()
+    {
+      return Awaiter<false>{handle};
+    }
+    
+    // The result of a finished task.
+    T get() { return handle.promise().result(); }
+  
+  private:
+    template<bool take>
+    struct Awaiter
+    {
+      std::coroutine_handle<promise_type> h;
+      
+      bool await_ready() { return !h || h.done(); }
+      
+      std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting)
+      {
+        h.promise().continuation = awaiting;
+        return h;
+      }
+      
+      auto await_resume()
+      {
+        if constexpr (take)
+          return h.promise().result();
+      }
+    };
+  };
+  
+  template<typename T>
+  Task<T> detail::Promise<T>::get_return_object()
+  {
+    return Task<T>{std::coroutine_handle<Promise<T>>::from_promise(*this)};
+  }
+  
+  Task<void> detail::Promise<void>::get_return_object()
+  {
+    return Task<void>{std::coroutine_handle<Promise<void>>::from_promise(*this)};
+  }
+  
+  // Runs task on the calling thread until it first suspends, then blocks until it finishes.
+  template<typename T>
+  T sync_wait(Task<T> task)
+  {
+    std::mutex mtx;
+    std::condition_variable cv;
+    bool done = false;
+    [](Task<T> &t, std::mutex &m, std::condition_variable &c, bool &d) -> detail::Detached
+    {
+      co_await t.when_done();
+      std::lock_guard l(m);
+      d = true;
+      c.notify_all();
+    }(task, mtx, cv, done);
+    std::unique_lock l(mtx);
+    cv.wait(l, [&done] { return done; });
+    return task.get();
+  }
+  
+  // One thread driving every transfer started from coroutines, with curl_multi_socket_action()
+  // over epoll. A coroutine suspends in `co_await http.get(loop)` and is resumed on the loop
+  // thread when the transfer is done, so thousands of transfers need no thread of their own.
+  // Transfers to the same host share HTTP/2 connections like on a Multi.
+  // Coroutines should not block for long once resumed: they hold up every other transfer.
+  class Loop
+  {
+  public:
+    // The awaitable of a transfer, see get(), post(), post_data() and perform().
+    class Transfer
+    {
+    private:
+      friend class Loop;
+      Loop &loop;
+      Http &http;
+      std::coroutine_handle<> waiter;
+      CURLcode result;
+    public:
+      Transfer(Loop &loop_, Http &http_) : loop(loop_), http(http_), result(CURLE_OK) {}
+      
+      bool await_ready() const noexcept { return false; }
+      
+      void await_suspend(std::coroutine_handle<> h)
+      {
+        waiter = h;
+        loop.start(*this);
+      }
+      
+      // Throws like Http::perform() if the transfer failed.
+      Http &await_resume()
+      {
+        check_curl(result);
+        return http;
+      }
+    };
+    
+    // Continues the awaiting coroutine on the loop thread.
+    struct Schedule
+    {
+      Loop &loop;
+      
+      bool await_ready() const noexcept { return false; }
+      
+      void await_suspend(std::coroutine_handle<> h) { loop.resume_later(h); }
+      
+      void await_resume() const noexcept {}
+    };
+  
+  private:
+    using Clock = std::chrono::steady_clock;
+    
+    CURLM *multi;
+    int epfd;
+    int wakefd;
+    std::thread thread;
+    
+    std::mutex mtx;
+    std::vector<Transfer *> incoming;
+    std::vector<std::coroutine_handle<>> resumable;
+    bool stopping;
+    
+    // only touched by the loop thread
+    std::map<CURL *, Transfer *> running;
+    std::multimap<Clock::time_point, Transfer *> throttled;// started once the RateLimiter allows
+    Clock::time_point deadline;// curl's next timeout
+    
+    std::mutex tasks_mtx;
+    std::condition_variable tasks_cv;
+    std::size_t tasks;
+  public:
+    Loop() : multi(nullptr), epfd(::epoll_create1(EPOLL_CLOEXEC)),
+             wakefd(::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)), stopping(false),
+             deadline(Clock::time_point::max()), tasks(0)
+    {
+      CurlPool::get();// initializes libcurl, and so is destroyed after the loop
+      multi = curl_multi_init();
+      sp_assert(multi != nullptr, "curl_multi_init() failed");
+      Multi::multiplex(multi);
+      sp_assert(epfd != -1 && wakefd != -1, "Creating the event loop failed.");
+      epoll_event ev{};
+      ev.events = EPOLLIN;
+      ev.data.fd = wakefd;
+      ::epoll_ctl(epfd, EPOLL_CTL_ADD, wakefd, &ev);
+      curl_multi_setopt(multi, CURLMOPT_SOCKETFUNCTION, socket_callback);
+      curl_multi_setopt(multi, CURLMOPT_SOCKETDATA, this);
+      curl_multi_setopt(multi, CURLMOPT_TIMERFUNCTION, timer_callback);
+      curl_multi_setopt(multi, CURLMOPT_TIMERDATA, this);
+      thread = std::thread([this] { run(); });
+    }
+    
+    Loop(const Loop &) = delete;
+    
+    // Transfers still running are dropped and their coroutines never resumed, see drain().
+    ~Loop()
+    {
+      {
+        std::lock_guard l(mtx);
+        stopping = true;
+      }
+      wake();
+      thread.join();
+      for (auto &r: running)
+        curl_multi_remove_handle(multi, r.first);
+      curl_multi_cleanup(multi);
+      ::close(wakefd);
+      ::close(epfd);
+    }
+    
+    static Loop &get()
+    {
+      static Loop loop;
+      return loop;
+    }
+    
+    Transfer get(Http &h)
+    {
+      h.prepare_get();
+      return {*this, h};
+    }
+    
+    Transfer post(Http &h, const Http::Form &form)
+    {
+      h.prepare_post(form);
+      return {*this, h};
+    }
+    
+    Transfer post_data(Http &h, const std::string &data)
+    {
+      h.prepare_post_data(data);
+      return {*this, h};
+    }
+    
+    // Runs a transfer set up by prepare_get() or prepare_post().
+    Transfer perform(Http &h) { return {*this, h}; }
+    
+    Schedule schedule() { return {*this}; }
+    
+    // Runs task on the loop thread without waiting for it. Its errors are reported
+    // the same way as retry() does.
+    void spawn(Task<void> task)
+    {
+      {
+        std::lock_guard l(tasks_mtx);
+        ++tasks;
+      }
+      [](Loop &loop, Task<void> t) -> detail::Detached
+      {
+        co_await loop.schedule();
+        try
+        {
+          co_await t;
+        }
+        catch (sp::Error &e)
+        {
+          std::cerr << e.get_content() << std::endl;
+        }
+        catch (...)
+        {
+          std::cerr << "Unexpected Error." << std::endl;
+        }
+        std::lock_guard l(loop.tasks_mtx);
+        if (--loop.tasks == 0)
+          loop.tasks_cv.notify_all();
+      }(*this, std::move(task));
+    }
+    
+    // Blocks until every spawned task has finished.
+    void drain()
+    {
+      std::unique_lock l(tasks_mtx);
+      tasks_cv.wait(l, [this] { return tasks == 0; });
+    }
+  
+  private:
+    void start(Transfer &t)
+    {
+      {
+        std::lock_guard l(mtx);
+        incoming.emplace_back(&t);
+      }
+      wake();
+    }
+    
+    void resume_later(std::coroutine_handle<> h)
+    {
+      {
+        std::lock_guard l(mtx);
+        resumable.emplace_back(h);
+      }
+      wake();
+    }
+    
+    void wake()
+    {
+      std::uint64_t one = 1;
+      [[maybe_unused]] auto n = ::write(wakefd, &one, sizeof(one));
+    }
+    
+    void run()
+    {
+      epoll_event events[64];
+      while (true)
+      {
+        std::vector<Transfer *> new_transfers;
+        std::vector<std::coroutine_handle<>> to_resume;
+        {
+          std::lock_guard l(mtx);
+          if (stopping) return;
+          new_transfers.swap(incoming);
+          to_resume.swap(resumable);
+        }
+        for (auto h: to_resume)
+          h.resume();
+        auto now = Clock::now();
+        for (auto t: new_transfers)
+        {
+          auto wait = RateLimiter::get().reserve(t->http.get_origin());
+          if (wait.count() <= 0)
+            add(*t);
+          else
+            throttled.emplace(now + std::chrono::duration_cast<Clock::duration>(wait), t);
+        }
+        while (!throttled.empty() && throttled.begin()->first <= now)
+        {
+          add(*throttled.begin()->second);
+          throttled.erase(throttled.begin());
+        }
+        
+        auto next = deadline;
+        if (!throttled.empty())
+          next = std::min(next, throttled.begin()->first);
+        int timeout = -1;
+        if (next != Clock::time_point::max())
+        {
+          auto ms = std::chrono::ceil<std::chrono::milliseconds>(next - now).count();
+          timeout = static_cast<int>(std::clamp<long long>(ms, 0, std::numeric_limits<int>::max()));
+        }
+        int n = ::epoll_wait(epfd, events, 64, timeout);
+        int still_running = 0;
+        for (int i = 0; i < n; ++i)
+        {
+          if (events[i].data.fd == wakefd)
+          {
+            std::uint64_t count;
+            [[maybe_unused]] auto r = ::read(wakefd, &count, sizeof(count));
+            continue;
+          }
+          int flags = 0;
+          if (events[i].events & EPOLLIN) flags |= CURL_CSELECT_IN;
+          if (events[i].events & EPOLLOUT) flags |= CURL_CSELECT_OUT;
+          if (events[i].events & (EPOLLERR | EPOLLHUP)) flags |= CURL_CSELECT_ERR;
+          curl_multi_socket_action(multi, events[i].data.fd, flags, &still_running);
+        }
+        if (Clock::now() >= deadline)
+        {
+          deadline = Clock::time_point::max();
+          curl_multi_socket_action(multi, CURL_SOCKET_TIMEOUT, 0, &still_running);
+        }
+        collect();
+      }
+    }
+    
+    void add(Transfer &t)
+    {
+      auto mret = curl_multi_add_handle(multi, t.http.handle());
+      if (mret != CURLM_OK)
+      {
+        std::cerr << "curl_multi_add_handle() failed: '" << curl_multi_strerror(mret) << "'." << std::endl;
+        t.result = CURLE_FAILED_INIT;
+        t.waiter.resume();
+        return;
+      }
+      running[t.http.handle()] = &t;
+    }
+    
+    // Resumes the coroutine of every finished transfer.
+    void collect()
+    {
+      int left = 0;
+      while (CURLMsg *msg = curl_multi_info_read(multi, &left))
+      {
+        if (msg->msg != CURLMSG_DONE) continue;
+        auto it = running.find(msg->easy_handle);
+        if (it == running.end()) continue;
+        auto t = it->second;
+        t->result = msg->data.result;
+        running.erase(it);
+        curl_multi_remove_handle(multi, t->http.handle());
+        t->http.finish();
+        t->waiter.resume();// may destroy t
+      }
+    }
+    
+    static int socket_callback(CURL *, curl_socket_t s, int what, void *userp, void *)
+    {
+      auto loop = static_cast<Loop *>(userp);
+      if (what == CURL_POLL_REMOVE)
+      {
+        ::epoll_ctl(loop->epfd, EPOLL_CTL_DEL, s, nullptr);
+        return 0;
+      }
+      epoll_event ev{};
+      ev.data.fd = s;
+      if (what & CURL_POLL_IN) ev.events |= EPOLLIN;
+      if (what & CURL_POLL_OUT) ev.events |= EPOLLOUT;
+      if (::epoll_ctl(loop->epfd, EPOLL_CTL_MOD, s, &ev) != 0 && errno == ENOENT)
+        ::epoll_ctl(loop->epfd, EPOLL_CTL_ADD, s, &ev);
+      return 0;
+    }
+    
+    static int timer_callback(CURLM *, long timeout_ms, void *userp)
+    {
+      auto loop = static_cast<Loop *>(userp);
+      loop->deadline = timeout_ms < 0 ? Clock::time_point::max()
+                                      : Clock::now() + std::chrono::milliseconds(timeout_ms);
+      return 0;
+    }
+  };
+}
+#endif
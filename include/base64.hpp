@@ -18,6 +18,7 @@
 #include <string>
 #include <array>
 #include <unordered_map>
+#include <mutex>
 namespace sp
 {
   std::string base64_encode(const std::string &data)
@@ -25,7 +26,11 @@ namespace sp
     static const std::string base64_chars = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
     // In this program, the data is just user:password, and couldn't change frequently.
     static std::unordered_map<std::string, std::string> cache;
-    if (auto it = cache.find(data); it != cache.end()) return it->second;
+    static std::mutex cache_lock;
+    {
+      std::lock_guard l(cache_lock);
+      if (auto it = cache.find(data); it != cache.end()) return it->second;
+    }
     std::string ret;
   
     int i = 0;
@@ -65,6 +70,7 @@ namespace sp
         ret += '=';
     }
     
+    std::lock_guard l(cache_lock);
     cache[data] = ret;
     return ret;
   }
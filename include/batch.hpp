@@ -0,0 +1,180 @@
+//   Copyright 2023 sotpider - caozhanhao
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+#ifndef SOTPIDER_BATCH_HPP
+#define SOTPIDER_BATCH_HPP
+#include "error.hpp"
+#include "uploader.h"
+#include "retry.hpp"
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <variant>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <iostream>
+#include <algorithm>
+namespace sp
+{
+  // Collects prepared posts and creates them through Uploader's /batch/v1 publish(),
+  // once `size` posts are waiting or the oldest has waited for `interval`.
+  // A post that failed goes into a later batch after a backoff, like a step in retry(),
+  // unless its failure is permanent or it has been tried max_attempts times (0: no limit).
+  // The callback receives the new post id, or the last error once the post is given up.
+  class PostBatcher
+  {
+  public:
+    using Callback = std::function<void(const std::variant<int, HttpError> &)>;
+  private:
+    using Clock = std::chrono::steady_clock;
+    struct Item
+    {
+      Uploader::PostForm form;
+      Callback on_done;
+      Clock::time_point added;// when it was added, or became due again after a failure
+      std::size_t attempts = 0;
+    };
+    
+    Uploader &uploader;
+    std::size_t size;
+    std::chrono::milliseconds interval;
+    Backoff backoff;
+    std::size_t max_attempts;
+    std::deque<Item> items;
+    std::multimap<Clock::time_point, Item> delayed;// failed, by when they are due again
+    std::mutex mtx;
+    std::condition_variable cv;
+    bool closing;
+    std::thread sender;
+  public:
+    PostBatcher(Uploader &uploader_, std::size_t size_, std::chrono::milliseconds interval_,
+                const Backoff &backoff_ = {}, std::size_t max_attempts_ = 0)
+        : uploader(uploader_), size(std::clamp<std::size_t>(size_, 1, 25)), interval(interval_),
+          backoff(backoff_), max_attempts(max_attempts_), closing(false)
+    {
+      sender = std::thread([this] { run(); });
+    }
+    
+    PostBatcher(const PostBatcher &) = delete;
+    
+    ~PostBatcher()
+    {
+      close();
+    }
+    
+    void add(Uploader::PostForm form, Callback on_done)
+    {
+      std::lock_guard l(mtx);
+      items.push_back({std::move(form), std::move(on_done), Clock::now()});
+      if (items.size() >= size)
+        cv.notify_all();
+    }
+    
+    // Sends what is left and waits until every post, retried ones included, is done or given up.
+    void close()
+    {
+      {
+        std::lock_guard l(mtx);
+        closing = true;
+        cv.notify_all();
+      }
+      if (sender.joinable())
+        sender.join();
+    }
+  
+  private:
+    void run()
+    {
+      std::unique_lock l(mtx);
+      while (true)
+      {
+        auto now = Clock::now();
+        while (!delayed.empty() && delayed.begin()->first <= now)
+        {
+          items.emplace_back(std::move(delayed.begin()->second));
+          delayed.erase(delayed.begin());
+        }
+        if (items.empty())
+        {
+          if (closing && delayed.empty()) return;
+          if (delayed.empty())
+            cv.wait_for(l, interval);
+          else
+            cv.wait_until(l, delayed.begin()->first);
+          continue;
+        }
+        auto deadline = items.front().added + interval;
+        if (items.size() < size && !closing && now < deadline)
+        {
+          cv.wait_until(l, delayed.empty() ? deadline : std::min(deadline, delayed.begin()->first));
+          continue;
+        }
+        std::vector<Item> batch;
+        while (!items.empty() && batch.size() < size)
+        {
+          batch.emplace_back(std::move(items.front()));
+          items.pop_front();
+        }
+        l.unlock();
+        send(batch);
+        l.lock();
+      }
+    }
+    
+    void send(std::vector<Item> &batch)
+    {
+      std::vector<std::variant<int, HttpError>> results;
+      try
+      {
+        std::vector<const Uploader::PostForm *> forms;
+        for (auto &r: batch)
+          forms.emplace_back(&r.form);
+        results = uploader.publish(forms);
+      }
+      catch (HttpError &e)
+      {
+        results.assign(batch.size(), e);
+      }
+      catch (sp::Error &e)// e.g. a malformed response, permanent like in retry()
+      {
+        results.assign(batch.size(), HttpError(e.get_content(), Failure::Permanent));
+      }
+      catch (...)
+      {
+        results.assign(batch.size(), HttpError("Unexpected Error.", Failure::Permanent));
+      }
+      for (std::size_t i = 0; i < batch.size(); ++i)
+      {
+        auto &item = batch[i];
+        auto error = std::get_if<HttpError>(&results[i]);
+        if (error == nullptr || !error->retryable()
+            || (max_attempts != 0 && item.attempts + 1 >= max_attempts))
+        {
+          item.on_done(results[i]);
+          continue;
+        }
+        std::cerr << error->get_content() << std::endl;
+        auto due = Clock::now() + backoff.delay(item.attempts, error->get_retry_after());
+        ++item.attempts;
+        item.added = due;
+        std::lock_guard l(mtx);
+        delayed.emplace(due, std::move(item));
+      }
+    }
+  };
+}
+#endif
\ No newline at end of file
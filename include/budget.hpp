@@ -0,0 +1,165 @@
+//   Copyright 2023 sotpider - caozhanhao
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+#ifndef SOTPIDER_BUDGET_HPP
+#define SOTPIDER_BUDGET_HPP
+#include "metrics.hpp"
+#include <string>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <algorithm>
+namespace sp
+{
+  // Bytes of memory or staging disk shared by every stage. Work that needs them takes
+  // a Lease first, and waits while the budget is spent, so a full budget slows the crawl
+  // down instead of getting the process killed or the disk filled.
+  class Budget
+  {
+  public:
+    // Bytes taken from a Budget, given back when the Lease is destroyed.
+    class Lease
+    {
+    private:
+      Budget *budget;
+      std::size_t bytes;
+    public:
+      Lease() : budget(nullptr), bytes(0) {}
+      
+      Lease(Budget *budget_, std::size_t bytes_) : budget(budget_), bytes(bytes_) {}
+      
+      Lease(Lease &&lease) noexcept : budget(lease.budget), bytes(lease.bytes)
+      {
+        lease.budget = nullptr;
+        lease.bytes = 0;
+      }
+      
+      Lease &operator=(Lease &&lease) noexcept
+      {
+        if (this != &lease)
+        {
+          release();
+          budget = lease.budget;
+          bytes = lease.bytes;
+          lease.budget = nullptr;
+          lease.bytes = 0;
+        }
+        return *this;
+      }
+      
+      ~Lease() { release(); }
+      
+      // Whether the bytes were granted.
+      explicit operator bool() const { return budget != nullptr; }
+      
+      [[nodiscard]] std::size_t size() const { return bytes; }
+      
+      // Adjusts the lease to what the work turned out to need. Never waits, so
+      // it may go over the limit, and the next acquire() waits a bit longer.
+      void resize(std::size_t bytes_)
+      {
+        if (budget == nullptr) return;
+        budget->adjust(bytes, bytes_);
+        bytes = bytes_;
+      }
+      
+      void release()
+      {
+        if (budget == nullptr) return;
+        budget->adjust(bytes, 0);
+        budget = nullptr;
+        bytes = 0;
+      }
+    };
+  
+  private:
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::string name;
+    std::size_t limit;// 0: no limit
+    std::size_t used;
+    
+    explicit Budget(std::string name_) : name(std::move(name_)), limit(0), used(0) {}
+  
+  public:
+    Budget(const Budget &) = delete;
+    
+    // Page bodies and relay buffers.
+    static Budget &memory()
+    {
+      static Budget budget("memory");
+      return budget;
+    }
+    
+    // Media staged in ~/.sotpider until it is uploaded.
+    static Budget &disk()
+    {
+      static Budget budget("disk");
+      return budget;
+    }
+    
+    void set_limit(std::size_t limit_)
+    {
+      std::lock_guard l(mtx);
+      limit = limit_;
+      cv.notify_all();
+    }
+    
+    // Blocks until bytes are free. More than the whole budget is granted once
+    // nothing else holds any, so a huge file still gets through, alone.
+    Lease acquire(std::size_t bytes)
+    {
+      std::unique_lock l(mtx);
+      if (!fits(bytes))
+      {
+        auto start = std::chrono::steady_clock::now();
+        cv.wait(l, [this, bytes] { return fits(bytes); });
+        Metrics::get().observe("sotpider_budget_wait_seconds", {{"resource", name}},
+                               std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+      }
+      used += bytes;
+      return {this, bytes};
+    }
+    
+    // An empty Lease if the bytes are not free now.
+    Lease try_acquire(std::size_t bytes)
+    {
+      std::lock_guard l(mtx);
+      if (!fits(bytes)) return {};
+      used += bytes;
+      return {this, bytes};
+    }
+    
+    std::size_t in_use()
+    {
+      std::lock_guard l(mtx);
+      return used;
+    }
+  
+  private:
+    // Called with mtx held.
+    [[nodiscard]] bool fits(std::size_t bytes) const
+    {
+      return limit == 0 || used == 0 || used + bytes <= limit;
+    }
+    
+    void adjust(std::size_t from, std::size_t to)
+    {
+      std::lock_guard l(mtx);
+      used = used - from + to;
+      if (to < from)
+        cv.notify_all();
+    }
+  };
+}
+#endif
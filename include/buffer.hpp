@@ -0,0 +1,96 @@
+//   Copyright 2023 sotpider - caozhanhao
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+#ifndef SOTPIDER_BUFFER_HPP
+#define SOTPIDER_BUFFER_HPP
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <algorithm>
+namespace sp
+{
+  // Recycles response bodies. A buffer from acquire() returns to the pool, capacity
+  // and all, when its last shared_ptr is gone, so a body that is still referenced
+  // (e.g. by a parse or upload still reading it) is never reused early.
+  class BufferPool
+  {
+  private:
+    std::mutex mtx;
+    std::vector<std::string *> idle;
+    std::size_t idle_bytes;// capacity of the idle buffers
+    std::size_t max_idle;
+    std::size_t max_idle_bytes;
+    std::size_t max_capacity;
+    
+    BufferPool() : idle_bytes(0), max_idle(64), max_idle_bytes(64 * 1024 * 1024), max_capacity(16 * 1024 * 1024) {}
+  
+  public:
+    BufferPool(const BufferPool &) = delete;
+    
+    ~BufferPool()
+    {
+      for (auto p: idle)
+        delete p;
+    }
+    
+    static BufferPool &get()
+    {
+      static BufferPool pool;
+      return pool;
+    }
+    
+    // Prefers the smallest idle buffer that already holds size_hint bytes.
+    std::shared_ptr<std::string> acquire(std::size_t size_hint = 0)
+    {
+      std::string *buf = nullptr;
+      {
+        std::lock_guard l(mtx);
+        if (!idle.empty())
+        {
+          auto it = std::min_element(idle.begin(), idle.end(), [size_hint](auto a, auto b)
+          {
+            bool fa = a->capacity() >= size_hint, fb = b->capacity() >= size_hint;
+            if (fa != fb) return fa;
+            return fa ? a->capacity() < b->capacity() : a->capacity() > b->capacity();
+          });
+          buf = *it;
+          idle.erase(it);
+          idle_bytes -= buf->capacity();
+        }
+      }
+      if (buf == nullptr)
+        buf = new std::string;
+      buf->reserve(size_hint);
+      return {buf, [this](std::string *p) { release(p); }};
+    }
+  
+  private:
+    void release(std::string *buf)
+    {
+      buf->clear();
+      if (buf->capacity() <= max_capacity)
+      {
+        std::lock_guard l(mtx);
+        if (idle.size() < max_idle && idle_bytes + buf->capacity() <= max_idle_bytes)
+        {
+          idle_bytes += buf->capacity();
+          idle.emplace_back(buf);
+          return;
+        }
+      }
+      delete buf;
+    }
+  };
+}
+#endif
\ No newline at end of file
@@ -0,0 +1,280 @@
+//   Copyright 2023 sotpider - caozhanhao
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+#ifndef SOTPIDER_DOWNLOAD_HPP
+#define SOTPIDER_DOWNLOAD_HPP
+#include "error.hpp"
+#include "http.hpp"
+#include "hash.hpp"
+#include "retry.hpp"
+#include "curl/curl.h"
+#include <string>
+#include <vector>
+#include <memory>
+#include <fstream>
+#include <filesystem>
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+namespace sp
+{
+  struct DownloadOptions
+  {
+    int timeout = -1;
+    std::size_t ranges = 1;// parallel ranges for a large file, 1: one stream
+    curl_off_t range_threshold = 64 << 20;// smallest file in bytes worth splitting
+  };
+  
+  // One file downloaded into path + ".part", and renamed to path once its size checks out.
+  // A failed attempt leaves the .part behind, and the next Download of the same path
+  // asks only for the missing bytes with a Range request. A file of at least
+  // range_threshold bytes is split into `ranges` ranges fetched in parallel into the
+  // preallocated .part, with their progress kept in path + ".part.ranges" between attempts.
+  class Download
+  {
+  private:
+    struct Range
+    {
+      curl_off_t begin;
+      curl_off_t end;// inclusive, -1: to the end of the file
+      curl_off_t done;// bytes from begin already in the file
+      Sink sink;
+      std::unique_ptr<Http> http;
+    };
+    
+    std::string url;
+    std::string path;
+    std::string part;
+    std::string state;
+    DownloadOptions options;
+    int fd;
+    curl_off_t total;// -1: unknown
+    bool accepts_ranges;
+    bool streamed;// the whole file went through the hash while downloading
+    std::unique_ptr<Http> head;
+    std::vector<Range> ranges;
+  public:
+    Download(std::string url_, std::string path_, DownloadOptions options_)
+        : url(std::move(url_)), path(std::move(path_)), part(path + ".part"), state(part + ".ranges"),
+          options(options_), fd(-1), total(-1), accepts_ranges(false), streamed(false) {}
+    
+    Download(const Download &) = delete;
+    
+    ~Download()
+    {
+      ranges.clear();// their writers may still hold data for fd
+      if (fd != -1) ::close(fd);
+    }
+    
+    // A HEAD request for the size, if the file may be split. nullptr if there is nothing to ask.
+    Http *probe()
+    {
+      if (options.ranges <= 1 || std::filesystem::exists(state)) return nullptr;
+      head = std::make_unique<Http>(url);
+      if (options.timeout != -1) head->set_timeout(options.timeout);
+      head->set_stage(Stage::MediaDownload).set_str().prepare_head();
+      return head.get();
+    }
+    
+    // Called once the probe() is done. A failed probe just means no splitting.
+    void probed()
+    {
+      if (head == nullptr) return;
+      if (head->response_code / 100 == 2)
+      {
+        curl_easy_getinfo(head->handle(), CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &total);
+        auto it = head->response.headers.find("accept-ranges");
+        accepts_ranges = it != head->response.headers.end() && it->second == "bytes";
+      }
+      head.reset();
+    }
+    
+    // The transfers still to be done. If hash is given and the file is fetched
+    // in one piece from the start, it is hashed on the way.
+    std::vector<Http *> start(Hash64 *hash = nullptr)
+    {
+      fd = ::open(part.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+      sp_assert(fd != -1, "Open '" + part + "' failed.");
+      if (!load())
+      {
+        struct stat st{};
+        ::fstat(fd, &st);
+        if (options.ranges > 1 && accepts_ranges && total >= options.range_threshold && st.st_size == 0)
+          split();
+        else
+        {
+          ranges.clear();
+          ranges.push_back({0, -1, st.st_size, {}, nullptr});
+          if (st.st_size != 0)
+            std::cerr << "Resuming " << path << " from " << st.st_size << " bytes." << std::endl;
+        }
+      }
+      std::vector<Http *> ret;
+      for (auto &r: ranges)
+      {
+        if (r.end != -1 && r.begin + r.done > r.end) continue;
+        r.http = std::make_unique<Http>(url);
+        r.sink.fd = fd;
+        if (options.timeout != -1) r.http->set_timeout(options.timeout);
+        r.http->set_stage(Stage::MediaDownload).set_sink(r.sink, r.begin + r.done, r.end);
+        r.http->prepare_get();
+        ret.emplace_back(r.http.get());
+      }
+      streamed = hash != nullptr && ranges.size() == 1 && ranges[0].done == 0;
+      if (streamed)
+        ranges[0].http->set_hash(*hash);
+      return ret;
+    }
+    
+    bool owns(const Http *h) const
+    {
+      return std::any_of(ranges.begin(), ranges.end(), [h](auto &r) { return r.http.get() == h; });
+    }
+    
+    // Whether every transfer of the file has finished.
+    bool done() const
+    {
+      return std::all_of(ranges.begin(), ranges.end(), [](auto &r) { return r.http == nullptr; });
+    }
+    
+    // Called when h, one of the transfers from start(), is done. Throws if it failed.
+    void finished(Http &h, CURLcode cret)
+    {
+      auto r = std::find_if(ranges.begin(), ranges.end(), [&h](auto &r) { return r.http.get() == &h; });
+      sp_assert(r != ranges.end(), "Unknown transfer.");
+      auto flushed = r->sink.flush();
+      r->done = r->sink.offset + (flushed ? r->sink.written : 0) - r->begin;
+      auto ignored = r->sink.ignored;
+      auto code = h.response_code;
+      std::string content_range;
+      if (auto it = h.response.headers.find("content-range"); it != h.response.headers.end())
+        content_range = it->second;
+      curl_off_t length = -1;
+      curl_easy_getinfo(h.handle(), CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length);
+      auto http = std::move(r->http);// h lives until the end of this call
+      if (!flushed)
+      {
+        if (ranges.size() == 1)
+          ::ftruncate(fd, r->sink.offset);
+        throw HttpError("Writing " + part + " failed: " + std::strerror(r->sink.writer->failure()) + ".",
+                        Failure::Transient);
+      }
+      // "bytes 100-999/1000" or, with a 416, "bytes */1000"
+      auto slash = content_range.rfind('/');
+      curl_off_t size = -1;
+      if (slash != std::string::npos && content_range.substr(slash + 1) != "*")
+        size = std::stoll(content_range.substr(slash + 1));
+      if (ignored)
+      {
+        std::filesystem::remove(state);
+        throw HttpError("The server ignored the Range of " + url + ".", Failure::Transient);
+      }
+      if (code == 416 && ranges.size() == 1 && size >= 0 && size == r->begin + r->done)
+      {
+        total = size;// the .part was already complete
+        return;
+      }
+      if (code == 416)
+      {
+        // the .part is not a prefix of the file anymore, start over
+        ::ftruncate(fd, 0);
+        std::filesystem::remove(state);
+        throw HttpError("Range not satisfiable: " + url + ".", Failure::Transient);
+      }
+      check_curl(cret);
+      h.check_status();
+      if (r->end != -1 && r->begin + r->done != r->end + 1)
+        throw HttpError("Short range from " + url + ".", Failure::Transient);
+      if (ranges.size() == 1 && total == -1)
+      {
+        if (code == 206 && size >= 0)
+          total = size;
+        else if (code == 200 && length >= 0)
+          total = length;
+      }
+    }
+    
+    // Keeps the progress of split downloads for the next attempt. Called when an attempt fails.
+    void suspend()
+    {
+      if (ranges.size() <= 1 || fd == -1) return;
+      for (auto &r: ranges)
+        if (r.http != nullptr)
+          r.done = r.sink.offset + (r.sink.flush() ? r.sink.written : 0) - r.begin;
+      save();
+    }
+    
+    // Checks the size and moves the file into place. If hash is given, it receives the Hash64::hex() of the file.
+    void commit(std::string *hash = nullptr)
+    {
+      struct stat st{};
+      ::fstat(fd, &st);
+      ::close(fd);
+      fd = -1;
+      if (total >= 0 && st.st_size != total)
+      {
+        std::filesystem::remove(part);
+        std::filesystem::remove(state);
+        throw HttpError("Downloaded " + std::to_string(st.st_size) + " of " + std::to_string(total)
+                        + " bytes from " + url + ".", Failure::Transient);
+      }
+      std::filesystem::rename(part, path);
+      std::filesystem::remove(state);
+      if (hash == nullptr || streamed) return;
+      std::ifstream in(path, std::ios_base::binary);
+      Hash64 h;
+      char buf[64 * 1024];
+      while (in.read(buf, sizeof(buf)) || in.gcount() > 0)
+        h.update(buf, static_cast<std::size_t>(in.gcount()));
+      *hash = h.hex();
+    }
+  
+  private:
+    void save()
+    {
+      std::ofstream out(state, std::ios_base::out | std::ios_base::trunc);
+      out << total << '\n';
+      for (auto &r: ranges)
+        out << r.begin << ' ' << r.end << ' ' << r.done << '\n';
+    }
+    
+    // Reads the ranges left by a failed attempt.
+    bool load()
+    {
+      std::ifstream in(state);
+      if (!in.is_open() || !(in >> total)) return false;
+      ranges.clear();
+      Range r{};
+      while (in >> r.begin >> r.end >> r.done)
+        ranges.push_back({r.begin, r.end, r.done, {}, nullptr});
+      if (ranges.size() < 2) return false;
+      std::cerr << "Resuming " << path << " in " << ranges.size() << " ranges." << std::endl;
+      return true;
+    }
+    
+    void split()
+    {
+      auto n = static_cast<curl_off_t>(options.ranges);
+      auto size = (total + n - 1) / n;
+      ranges.clear();
+      for (curl_off_t begin = 0; begin < total; begin += size)
+        ranges.push_back({begin, std::min(begin + size, total) - 1, 0, {}, nullptr});
+      if (::posix_fallocate(fd, 0, total) != 0)
+        ::ftruncate(fd, total);
+      save();// a crash from here on restarts the ranges instead of taking the .part for complete
+    }
+  };
+}
+#endif
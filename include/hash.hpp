@@ -0,0 +1,145 @@
+//   Copyright 2023 sotpider - caozhanhao
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+#ifndef SOTPIDER_HASH_HPP
+#define SOTPIDER_HASH_HPP
+#include <cstdint>
+#include <cstring>
+#include <string>
+namespace sp
+{
+  // Streaming XXH64, fed while a body is being received.
+  class Hash64
+  {
+  private:
+    static constexpr std::uint64_t p1 = 11400714785074694791ULL;
+    static constexpr std::uint64_t p2 = 14029467366897019727ULL;
+    static constexpr std::uint64_t p3 = 1609587929392839161ULL;
+    static constexpr std::uint64_t p4 = 9650029242287828579ULL;
+    static constexpr std::uint64_t p5 = 2870177450012600261ULL;
+    std::uint64_t v[4];
+    unsigned char buffer[32];
+    std::size_t buffered;
+    std::uint64_t total;
+    std::uint64_t seed;
+  public:
+    explicit Hash64(std::uint64_t seed_ = 0) : seed(seed_) { reset(); }
+    
+    void reset()
+    {
+      v[0] = seed + p1 + p2;
+      v[1] = seed + p2;
+      v[2] = seed;
+      v[3] = seed - p1;
+      buffered = 0;
+      total = 0;
+    }
+    
+    void update(const void *data, std::size_t size)
+    {
+      auto p = static_cast<const unsigned char *>(data);
+      total += size;
+      if (buffered + size < 32)
+      {
+        std::memcpy(buffer + buffered, p, size);
+        buffered += size;
+        return;
+      }
+      if (buffered != 0)
+      {
+        auto n = 32 - buffered;
+        std::memcpy(buffer + buffered, p, n);
+        stripe(buffer);
+        p += n;
+        size -= n;
+        buffered = 0;
+      }
+      for (; size >= 32; p += 32, size -= 32)
+        stripe(p);
+      std::memcpy(buffer, p, size);
+      buffered = size;
+    }
+    
+    [[nodiscard]] std::uint64_t digest() const
+    {
+      std::uint64_t h;
+      if (total >= 32)
+      {
+        h = rotl(v[0], 1) + rotl(v[1], 7) + rotl(v[2], 12) + rotl(v[3], 18);
+        for (auto x: v)
+          h = (h ^ round(0, x)) * p1 + p4;
+      }
+      else
+        h = seed + p5;
+      h += total;
+      std::size_t i = 0;
+      for (; i + 8 <= buffered; i += 8)
+        h = rotl(h ^ round(0, read64(buffer + i)), 27) * p1 + p4;
+      if (i + 4 <= buffered)
+      {
+        h = rotl(h ^ (read32(buffer + i) * p1), 23) * p2 + p3;
+        i += 4;
+      }
+      for (; i < buffered; ++i)
+        h = rotl(h ^ (buffer[i] * p5), 11) * p1;
+      h ^= h >> 33;
+      h *= p2;
+      h ^= h >> 29;
+      h *= p3;
+      h ^= h >> 32;
+      return h;
+    }
+    
+    // 16 lowercase hex digits.
+    [[nodiscard]] std::string hex() const
+    {
+      static const char digits[] = "0123456789abcdef";
+      auto h = digest();
+      std::string ret(16, '0');
+      for (int i = 15; i >= 0; --i, h >>= 4)
+        ret[i] = digits[h & 0xf];
+      return ret;
+    }
+  
+  private:
+    static std::uint64_t rotl(std::uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+    
+    static std::uint64_t round(std::uint64_t acc, std::uint64_t input)
+    {
+      return rotl(acc + input * p2, 31) * p1;
+    }
+    
+    static std::uint64_t read64(const unsigned char *p)
+    {
+      std::uint64_t x = 0;
+      for (int i = 7; i >= 0; --i)
+        x = (x << 8) | p[i];
+      return x;
+    }
+    
+    static std::uint64_t read32(const unsigned char *p)
+    {
+      std::uint64_t x = 0;
+      for (int i = 3; i >= 0; --i)
+        x = (x << 8) | p[i];
+      return x;
+    }
+    
+    void stripe(const unsigned char *p)
+    {
+      for (int i = 0; i < 4; ++i)
+        v[i] = round(v[i], read64(p + i * 8));
+    }
+  };
+}
+#endif
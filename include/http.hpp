@@ -14,6 +14,14 @@
 #ifndef SOTPIDER_HTTP_HPP
 #define SOTPIDER_HTTP_HPP
 #include "error.hpp"
+#include "pool.hpp"
+#include "relay.hpp"
+#include "buffer.hpp"
+#include "writer.hpp"
+#include "hash.hpp"
+#include "retry.hpp"
+#include "metrics.hpp"
+#include "budget.hpp"
 #include "curl/curl.h"
 #include <memory>
 #include <string>
@@ -21,83 +29,232 @@
 #include <vector>
 #include <utility>
 #include <fstream>
+#include <string_view>
 #include <iostream>
 #include <thread>
+#include <map>
+#include <algorithm>
+#include <cctype>
+#include <unistd.h>
+#include <atomic>
+#include <array>
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <chrono>
+#include <cstdio>
 namespace sp
 {
-  class Bar
+  // What a request is for, the "stage" label of its metrics.
+  enum class Stage { Other, Page, MediaDownload, MediaUpload, Tag, Post };
+  
+  const char *stage_name(Stage stage)
   {
+    switch (stage)
+    {
+      case Stage::Page:
+        return "page";
+      case Stage::MediaDownload:
+        return "media_download";
+      case Stage::MediaUpload:
+        return "media_upload";
+      case Stage::Tag:
+        return "tag";
+      case Stage::Post:
+        return "post";
+      default:
+        return "other";
+    }
+  }  
+  // One status line with the throughput of every transfer, by stage, redrawn every
+  // interval by a thread of its own. A transfer only adds to atomic counters from its
+  // XFERINFOFUNCTION, so reporting costs no lock and no terminal I/O.
+  // Stays off when stdout is not a terminal.
+  class Progress
+  {
+  public:
+    // What one transfer has reported so far.
+    struct Transfer
+    {
+      Stage stage = Stage::Other;
+      curl_off_t seen = 0;
+      bool active = false;
+      
+      ~Transfer() { end(); }
+      
+      void end()
+      {
+        if (active)
+          Progress::get().counters[static_cast<std::size_t>(stage)].active.fetch_sub(1, std::memory_order_relaxed);
+        active = false;
+        seen = 0;
+      }
+    };
+  
   private:
-    char padding;
-    char progress;
-    std::size_t size;
-    std::size_t finished_size;
-    std::size_t last_addition_size;
-    bool first;
+    static constexpr std::size_t stages = static_cast<std::size_t>(Stage::Post) + 1;
+    struct alignas(64) Counter
+    {
+      std::atomic<std::uint64_t> bytes{0};
+      std::atomic<std::int64_t> active{0};
+    };
+    
+    std::array<Counter, stages> counters;
+    std::atomic<bool> enabled;
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::thread renderer;
+    bool stopping;
+    
+    Progress() : enabled(false), stopping(false) {}
+  
   public:
-    Bar(std::size_t size_ = 36, char progress_ = '>', char padding_ = ' ')
-        : padding(padding_), progress(progress_), size(size_), finished_size(0),
-          last_addition_size(0), first(true) {}
-    Bar& set(std::size_t size_, char progress_, char padding_)
-    {
-      size = size_;
-      progress = progress_;
-      padding = padding_;
-      return *this;
+    Progress(const Progress &) = delete;
+    
+    ~Progress() { stop(); }
+    
+    static Progress &get()
+    {
+      static Progress progress;
+      return progress;
     }
-    Bar& update(double achieved_ratio, const std::string addition = "")
+    
+    bool on() const { return enabled.load(std::memory_order_relaxed); }
+    
+    static int xferinfo_callback(void *clientp, curl_off_t, curl_off_t dlnow, curl_off_t, curl_off_t ulnow)
     {
-      if (first)
+      auto t = static_cast<Transfer *>(clientp);
+      auto &c = get().counters[static_cast<std::size_t>(t->stage)];
+      if (!t->active)
       {
-        std::cout << "[" << std::string(size, padding) << "]"
-                  << add(addition) << std::flush;
-        first = false;
+        t->active = true;
+        c.active.fetch_add(1, std::memory_order_relaxed);
       }
-      if (finished_size < size && size * achieved_ratio - finished_size > 0.5)
+      auto now = dlnow + ulnow;
+      if (now > t->seen)// less after a redirect, which starts over
+        c.bytes.fetch_add(static_cast<std::uint64_t>(now - t->seen), std::memory_order_relaxed);
+      t->seen = now;
+      return 0;
+    }
+    
+    // Redraws the status line every interval until stop(). Does nothing if stdout is not a terminal.
+    void start(std::chrono::milliseconds interval)
+    {
+      stop();
+      if (interval.count() <= 0 || !::isatty(STDOUT_FILENO)) return;
+      std::lock_guard l(mtx);
+      stopping = false;
+      enabled = true;
+      renderer = std::thread([this, interval]
+                             {
+                               std::array<std::uint64_t, stages> last{};
+                               auto then = std::chrono::steady_clock::now();
+                               std::unique_lock l(mtx);
+                               while (!cv.wait_for(l, interval, [this] { return stopping; }))
+                               {
+                                 auto now = std::chrono::steady_clock::now();
+                                 auto line = render(last, std::chrono::duration<double>(now - then).count());
+                                 then = now;
+                                 std::cout.write(line.data(), static_cast<std::streamsize>(line.size()));
+                                 std::cout.flush();
+                               }
+                               std::cout << "\r\x1b[K" << std::flush;
+                             });
+    }
+    
+    void stop()
+    {
       {
-        finished_size++;
-        std::string d(last_addition_size + size + 2, '\b');
-        std::string output = "[";
-        output += std::string(finished_size, progress);
-        output += std::string(size - finished_size, padding);
-        output += "]";
-        output += add(addition);
-        std::cout << d << output << std::flush;
+        std::lock_guard l(mtx);
+        stopping = true;
+        enabled = false;
+        cv.notify_all();
       }
-      else
+      if (renderer.joinable())
+        renderer.join();
+    }
+  
+  private:
+    // "12 transfers 5.3 MiB/s 1.2 GiB | page 2 120.0 KiB/s | media_download 10 5.2 MiB/s",
+    // with the cursor left at the start of the line, so any other output overwrites it.
+    std::string render(std::array<std::uint64_t, stages> &last, double seconds)
+    {
+      std::string stats;
+      std::int64_t active = 0;
+      std::uint64_t total = 0, delta = 0;
+      for (std::size_t i = 0; i < stages; ++i)
       {
-        std::string d(last_addition_size, '\b');
-        auto p = add(addition);
-        std::cout << d << p << std::flush;
+        auto bytes = counters[i].bytes.load(std::memory_order_relaxed);
+        auto n = counters[i].active.load(std::memory_order_relaxed);
+        auto d = bytes - last[i];
+        last[i] = bytes;
+        total += bytes;
+        delta += d;
+        active += n;
+        if (n == 0 && d == 0) continue;
+        stats += " | ";
+        stats += stage_name(static_cast<Stage>(i));
+        stats += ' ' + std::to_string(n) + ' ' + human(static_cast<double>(d) / seconds) + "/s";
       }
-      return *this;
+      return std::to_string(active) + " transfers " + human(static_cast<double>(delta) / seconds) + "/s "
+             + human(static_cast<double>(total)) + stats + "\x1b[K\r";
     }
-  private:
-    std::string add(const std::string& addition)
+    
+    static std::string human(double bytes)
     {
-      std::string opt;
-      if (addition.size() < last_addition_size)
-        opt += std::string(last_addition_size - addition.size(), ' ');
-      last_addition_size = addition.size();
-      return addition + opt;
-    };
+      const char *units[] = {"B", "KiB", "MiB", "GiB", "TiB"};
+      std::size_t u = 0;
+      for (; bytes >= 1024 && u + 1 < std::size(units); ++u)
+        bytes /= 1024;
+      char buf[32];
+      std::snprintf(buf, sizeof(buf), "%.1f %s", bytes, units[u]);
+      return buf;
+    }
   };
+
+  
+  // Where a file download goes: pwrite() at offset + written, so several
+  // ranges can fill one file, and a download can go on where it stopped.
+  struct Sink
+  {
+    int fd = -1;
+    curl_off_t offset = 0;// where the requested range starts in the file
+    curl_off_t written = 0;
+    bool ranged = false;// a bounded range, which a 200 cannot satisfy
+    bool ignored = false;// the server answered a bounded range with the whole file
+    CURL *source = nullptr;
+    std::unique_ptr<FileWriter> writer;
+    
+    // Writes out what writer still holds. False if a write has failed, see FileWriter::failure().
+    bool flush() { return writer == nullptr || writer->flush(); }
+  };
+  
   class Response
   {
   private:
     std::variant<int,
         std::shared_ptr<std::string>,
-        std::shared_ptr<std::fstream>> value;//int EMPTY
+        std::shared_ptr<std::fstream>,
+        Relay *,
+        Sink *> value;//int EMPTY
+    CURL *source;
+    bool sized;
   public:
-    Response() : value(0) {}
+    std::map<std::string, std::string> headers;// lowercase name -> value, see Http::capture_headers()
+    Hash64 *hash;// fed with the body as it arrives, see Http::set_hash()
+    std::size_t decoded;// body bytes after any Content-Encoding was undone
+    Response() : value(0), source(nullptr), sized(false), hash(nullptr), decoded(0) {}
     
-    Response(const Response &res) : value(res.value) {}
+    Response(const Response &res) : value(res.value), source(res.source), sized(res.sized), headers(res.headers),
+                                     hash(res.hash), decoded(res.decoded) {}
     
-    void set_str()
+    // The body goes into a pooled buffer, taken once the first bytes arrive, when
+    // the Content-Length of source tells how large it has to be.
+    void set_str(CURL *source_ = nullptr)
     {
-      value.emplace<std::shared_ptr<std::string>>
-          (std::make_shared<std::string>
-               (std::string()));
+      value.emplace<std::shared_ptr<std::string>>(nullptr);
+      source = source_;
+      sized = false;
     }
     
     void set_file(const std::string &filename)
@@ -113,40 +270,246 @@ namespace sp
           (f);
     }
     
-    std::string str() { return *std::get<1>(value); }
+    void set_relay(Relay *relay, CURL *source_)
+    {
+      value.emplace<Relay *>(relay);
+      source = source_;
+    }
+    
+    void set_sink(Sink *sink)
+    {
+      value.emplace<Sink *>(sink);
+    }
+    
+    std::string_view str()
+    {
+      auto &buf = std::get<1>(value);
+      return buf == nullptr ? std::string_view{} : std::string_view{*buf};
+    }
     
-    std::shared_ptr<std::string> strp() { return std::get<1>(value); }
+    std::shared_ptr<std::string> strp() { return buffer(); }
+    
+    std::string &body() { return *buffer(); }
     
     std::shared_ptr<std::fstream> file() { return std::get<2>(value); }
     
+    Relay *relay() { return std::get<3>(value); }
+    
+    Sink *sink() { return std::get<4>(value); }
+    
     bool empty() { return value.index() == 0; }
+    
+    bool is_str() { return value.index() == 1; }
+    
+    // The response code of source so far, 0 before the headers.
+    long status()
+    {
+      long code = 0;
+      if (source != nullptr)
+        curl_easy_getinfo(source, CURLINFO_RESPONSE_CODE, &code);
+      return code;
+    }
+    
+    void reserve()
+    {
+      if (sized) return;
+      sized = true;
+      curl_off_t length = -1;
+      if (source != nullptr)
+        curl_easy_getinfo(source, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length);
+      buffer(length > 0 ? std::min<std::size_t>(length, 256 * 1024 * 1024) : 0);
+    }
+  
+  private:
+    // The body buffer, taken from the pool on first use.
+    std::shared_ptr<std::string> &buffer(std::size_t size_hint = 0)
+    {
+      auto &buf = std::get<1>(value);
+      if (buf == nullptr)
+        buf = BufferPool::get().acquire(size_hint);
+      else if (size_hint > buf->capacity())
+        buf->reserve(size_hint);
+      return buf;
+    }
   };
   
   std::size_t str_write_callback(void *data, size_t size, size_t nmemb, void *userp)
   {
     auto p = (Response *) userp;
-    p->strp()->append((char *) data, size * nmemb);
+    p->reserve();
+    p->body().append((char *) data, size * nmemb);
+    p->decoded += size * nmemb;
+    if (p->hash != nullptr) p->hash->update(data, size * nmemb);
     return size * nmemb;
   }
   
+  std::size_t header_callback(char *data, size_t size, size_t nitems, void *userp)
+  {
+    auto p = (Response *) userp;
+    std::string_view line(data, size * nitems);
+    if (line.substr(0, 5) == "HTTP/")// a new response, e.g. after a redirect
+      p->headers.clear();
+    else if (auto colon = line.find(':'); colon != std::string_view::npos)
+    {
+      std::string name(line.substr(0, colon));
+      std::transform(name.begin(), name.end(), name.begin(), [](unsigned char c) { return std::tolower(c); });
+      auto value = line.substr(colon + 1);
+      auto beg = value.find_first_not_of(" \t");
+      auto end = value.find_last_not_of(" \t\r\n");
+      p->headers[name] = beg == std::string_view::npos ? "" : std::string(value.substr(beg, end - beg + 1));
+    }
+    return size * nitems;
+  }
+  
   std::size_t file_write_callback(void *data, size_t size, size_t nmemb, void *userp)
   {
     auto p = (Response *) userp;
     p->file()->write((char *) data, size * nmemb);
+    p->decoded += size * nmemb;
+    if (p->hash != nullptr) p->hash->update(data, size * nmemb);
     return size * nmemb;
   }
   
-  static size_t progress_callback(void *clientp,
-                                  double dltotal,
-                                  double dlnow,
-                                  double ultotal,
-                                  double ulnow)
+  std::size_t relay_write_callback(void *data, size_t size, size_t nmemb, void *userp)
   {
-    auto *d = static_cast<Bar*>(clientp);
-    d->update(dlnow / dltotal);
-    return 0;
+    auto p = (Response *) userp;
+    if (p->status() / 100 != 2) return size * nmemb;// an error body is not the media, see Http::check_status()
+    if (!p->relay()->write((char *) data, size * nmemb))
+      return 0;
+    p->decoded += size * nmemb;
+    if (p->hash != nullptr) p->hash->update(data, size * nmemb);
+    return size * nmemb;
   }
   
+  std::size_t sink_write_callback(void *data, size_t size, size_t nmemb, void *userp)
+  {
+    auto p = (Response *) userp;
+    auto s = p->sink();
+    auto n = size * nmemb;
+    long code = 0;
+    curl_easy_getinfo(s->source, CURLINFO_RESPONSE_CODE, &code);
+    if (code / 100 != 2) return n;// an error body is not part of the file, see Http::check_status()
+    if (code == 200 && (s->ranged || s->offset != 0))
+    {
+      if (s->ranged)
+      {
+        s->ignored = true;
+        return 0;
+      }
+      // the server does not resume, start over
+      if (::ftruncate(s->fd, 0) != 0) return 0;
+      s->offset = 0;
+      s->writer->seek(0);
+    }
+    if (s->written == 0)
+    {
+      curl_off_t length = -1;
+      curl_easy_getinfo(s->source, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length);
+      s->writer->preallocate(length);
+    }
+    if (!s->writer->write(static_cast<char *>(data), n)) return 0;
+    s->written += static_cast<curl_off_t>(n);
+    p->decoded += n;
+    if (p->hash != nullptr) p->hash->update(data, n);
+    return n;
+  }
+  
+  // The series of one stage and host, see Http::record(). Resolved on the first request
+  // and kept, so a request only pays for one lookup and its atomic updates.
+  class HttpSeries
+  {
+  public:
+    enum Phase { DNS, Connect, TLS, Wait, Receive };
+    Metrics::Counter download;// bytes as on the wire
+    Metrics::Counter decoded;
+    Metrics::Counter upload;
+    std::array<Metrics::Histogram, 5> phases;
+    Metrics::Histogram total;
+  private:
+    static constexpr std::size_t codes = 600;// 0 for no response, or a status up to 599
+    static constexpr const char *versions[] = {"unknown", "1.0", "1.1", "2", "3"};
+    static constexpr std::size_t version_count = std::size(versions);
+    Metrics::Labels labels;
+    std::mutex mtx;// only taken to resolve a new (code, version)
+    std::unique_ptr<std::atomic<Metrics::Counter *>[]> requests;// [code * version_count + version]
+  public:
+    explicit HttpSeries(Metrics::Labels labels_)
+        : labels(std::move(labels_)), requests(std::make_unique<std::atomic<Metrics::Counter *>[]>(codes * version_count))
+    {
+      auto &m = Metrics::get();
+      download = m.counter("sotpider_http_download_bytes_total", labels);
+      decoded = m.counter("sotpider_http_decoded_bytes_total", labels);
+      upload = m.counter("sotpider_http_upload_bytes_total", labels);
+      const char *names[] = {"dns", "connect", "tls", "wait", "receive"};
+      for (std::size_t i = 0; i < phases.size(); ++i)
+      {
+        auto l = labels;
+        l.emplace_back("phase", names[i]);
+        phases[i] = m.histogram("sotpider_http_phase_seconds", l);
+      }
+      total = m.histogram("sotpider_http_request_seconds", labels);
+    }
+    
+    HttpSeries(const HttpSeries &) = delete;
+    
+    ~HttpSeries()
+    {
+      for (std::size_t i = 0; i < codes * version_count; ++i)
+        delete requests[i].load();
+    }
+    
+    static HttpSeries &of(Stage stage, const std::string &host)
+    {
+      static std::shared_mutex mtx;
+      static std::map<std::pair<Stage, std::string>, std::unique_ptr<HttpSeries>> all;
+      {
+        std::shared_lock l(mtx);
+        auto it = all.find({stage, host});
+        if (it != all.end()) return *it->second;
+      }
+      std::lock_guard l(mtx);
+      auto &s = all[{stage, host}];
+      if (s == nullptr)
+        s = std::make_unique<HttpSeries>(Metrics::Labels{{"stage", stage_name(stage)}, {"host", host}});
+      return *s;
+    }
+    
+    // Without a lock once the (code, version) has been seen.
+    Metrics::Counter requests_of(long code, long version)
+    {
+      if (code < 0 || code >= static_cast<long>(codes)) code = 0;
+      auto v = version_index(version);
+      auto &slot = requests[static_cast<std::size_t>(code) * version_count + v];
+      if (auto c = slot.load(std::memory_order_acquire); c != nullptr) return *c;
+      std::lock_guard l(mtx);
+      if (auto c = slot.load(std::memory_order_relaxed); c != nullptr) return *c;
+      auto counted = labels;
+      counted.emplace_back("code", std::to_string(code));
+      counted.emplace_back("version", versions[v]);
+      auto c = new Metrics::Counter(Metrics::get().counter("sotpider_http_requests_total", counted));
+      slot.store(c, std::memory_order_release);
+      return *c;
+    }
+  
+  private:
+    static std::size_t version_index(long version)
+    {
+      switch (version)
+      {
+        case CURL_HTTP_VERSION_1_0:
+          return 1;
+        case CURL_HTTP_VERSION_1_1:
+          return 2;
+        case CURL_HTTP_VERSION_2_0:
+          return 3;
+        case CURL_HTTP_VERSION_3:
+          return 4;
+        default:// e.g. 0 when no response came
+          return 0;
+      }
+    }
+  };
+  
   class Http
   {
   public:
@@ -158,32 +521,38 @@ namespace sp
   private:
     CURL *curl;
     struct curl_slist *headers;
-    Bar bar;
+    curl_mime *mime;
+    std::string origin;// for the RateLimiter
+    Stage stage;
+    Progress::Transfer progress;
+    Budget::Lease lease;
   public:
-    Http() : response_code(-1), curl(curl_easy_init()), headers(nullptr)
-    {
-      sp_assert(curl != nullptr, "curl_easy_init() failed");
-    }
-    
-    Http(const std::string &url_) : response_code(-1), curl(curl_easy_init()), headers(nullptr)
+    // The url is required up front: it picks the pooled handle, and its origin the RateLimiter bucket.
+    explicit Http(const std::string &url_) : response_code(-1), curl(CurlPool::get().acquire(origin_of(url_))),
+                                  headers(nullptr), mime(nullptr), stage(Stage::Other)
     {
-      sp_assert(curl != nullptr, "curl_easy_init() failed");
       set_url(url_);
+      capture_headers();
+      negotiate();
+      report_progress();
     }
     
     Http(const Http &http) = delete;
     
     ~Http()
     {
-      curl_easy_cleanup(curl);
+      CurlPool::get().release(curl);
       if(headers != nullptr)
         curl_slist_free_all(headers);
+      if(mime != nullptr)
+        curl_mime_free(mime);
     }
     
     Http &set_url(const std::string &url_)
     {
       auto url = url_;
       curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+      origin = origin_of(url);
       return *this;
     }
     Http &set_timeout(int sotpider_timeout)
@@ -192,6 +561,13 @@ namespace sp
       curl_easy_setopt(curl, CURLOPT_TIMEOUT, sotpider_timeout);
       return *this;
     }
+    Http &set_stage(Stage stage_)
+    {
+      stage = stage_;
+      progress.stage = stage_;
+      return *this;
+    }
+    
     Http &set_header(const std::vector<std::string> &header)
     {
       sp_assert(!header.empty(), "Empty header.");
@@ -200,15 +576,27 @@ namespace sp
       curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
       return *this;
     }
-    Http &set_bar()
+    
+    // Keeps lease, memory taken for the body, as long as the Http lives.
+    // Once the transfer is done, the lease is resized to what the body holds.
+    Http &set_budget(Budget::Lease lease_)
+    {
+      lease = std::move(lease_);
+      return *this;
+    }
+    
+    // Adds the transfer to the status line of Progress, if it is shown. On by default.
+    Http &report_progress()
     {
-      curl_easy_setopt(curl, CURLOPT_PROGRESSDATA, &bar);
-      curl_easy_setopt(curl, CURLOPT_PROGRESSFUNCTION, progress_callback);
+      if (!Progress::get().on()) return *this;
+      curl_easy_setopt(curl, CURLOPT_XFERINFODATA, &progress);
+      curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, Progress::xferinfo_callback);
+      curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
       return *this;
     }
     Http &set_str()
     {
-      response.set_str();
+      response.set_str(curl);
       curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, str_write_callback);
       curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
       return *this;
@@ -222,25 +610,195 @@ namespace sp
       return *this;
     }
     
-    Http &get()
+    // Hashes the body while it is received. hash must outlive the transfer.
+    Http &set_hash(Hash64 &hash)
+    {
+      hash.reset();
+      response.hash = &hash;
+      return *this;
+    }
+    
+    // Keeps the response headers in response.headers. On by default, for Retry-After.
+    Http &capture_headers()
+    {
+      curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, header_callback);
+      curl_easy_setopt(curl, CURLOPT_HEADERDATA, &response);
+      return *this;
+    }
+    
+    // Writes the body, or the bytes [begin, end] of it, into sink->fd from offset begin.
+    // end = -1: up to the end of the file. begin = 0 and end = -1 asks for the whole file.
+    Http &set_sink(Sink &sink, curl_off_t begin = 0, curl_off_t end = -1)
+    {
+      sink.source = curl;
+      sink.offset = begin;
+      sink.written = 0;
+      sink.ranged = end >= 0;
+      sink.ignored = false;
+      sp_assert(sink.fd != -1, "No file.");
+      sink.writer = std::make_unique<FileWriter>(sink.fd, begin);
+      response.set_sink(&sink);
+      if (begin > 0 || end >= 0)
+      {
+        auto range = std::to_string(begin) + "-" + (end >= 0 ? std::to_string(end) : "");
+        curl_easy_setopt(curl, CURLOPT_RANGE, range.c_str());
+      }
+      curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, sink_write_callback);
+      curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
+      return *this;
+    }
+    
+    // HTTP/2 over TLS where the server offers it, HTTP/1.1 otherwise. On a Multi,
+    // a transfer waits for a connection to the same host to multiplex on,
+    // rather than opening a new one. On by default.
+    Http &negotiate()
+    {
+      curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+      curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+      return *this;
+    }
+    
+    // Asks for a gzip, br or zstd body, whichever libcurl was built with. libcurl
+    // decodes it chunk by chunk as it arrives, so the write callbacks, and a
+    // page parser after them, only ever see the decoded bytes.
+    // Only for text such as JSON pages: media is already compressed, and a Relay
+    // needs the Content-Length of the decoded body.
+    Http &set_compressed()
+    {
+      curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "");
+      return *this;
+    }
+    
+    // Streams the body into relay instead of keeping it.
+    Http &set_relay(Relay &relay)
+    {
+      response.set_relay(&relay, curl);
+      relay.set_source(curl);
+      curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, relay_write_callback);
+      curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
+      return *this;
+    }
+    
+    Http &prepare_get()
     {
       if (response.empty())
         set_str();
       curl_easy_setopt(curl, CURLOPT_HTTPGET, 1L);
+      return *this;
+    }
+    
+    Http &get()
+    {
+      prepare_get();
+      return perform();
+    }
+    
+    // Like prepare_get(), but only the headers are requested. Set last: HTTPGET turns NOBODY off.
+    Http &prepare_head()
+    {
+      prepare_get();
+      curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+      return *this;
+    }
+    
+    // `co_await http.get(loop)`: like get(), but suspends the calling coroutine instead
+    // of the thread, until the transfer on loop is done. See Loop in async.hpp.
+    template<typename Loop>
+    auto get(Loop &loop) { return loop.get(*this); }
+    
+    template<typename Loop>
+    auto post(Loop &loop, const Form &form) { return loop.post(*this, form); }
+    
+    template<typename Loop>
+    auto post_data(Loop &loop, const std::string &data) { return loop.post_data(*this, data); }
+    
+    // Runs a transfer set up by prepare_get() or prepare_post().
+    Http &perform()
+    {
+      throttle();
       auto cret = curl_easy_perform(curl);
-      sp::sp_assert(cret == CURLE_OK,
-                    "curl_easy_perform() failed: '" + std::string(curl_easy_strerror(cret)) + "'.");
+      finish();
+      check_curl(cret);
+      return *this;
+    }
+    
+    // Blocks until the RateLimiter allows another request to the origin.
+    Http &throttle()
+    {
+      RateLimiter::get().before(origin);
+      return *this;
+    }
+    
+    // Called once the transfer is done, whether by get() or by a Multi.
+    Http &finish()
+    {
       curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
+      curl_off_t down = 0, up = 0;
+      curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &down);
+      curl_easy_getinfo(curl, CURLINFO_SIZE_UPLOAD_T, &up);
+      RateLimiter::get().after(origin, static_cast<double>(down + up));
+      record(down, up);
+      progress.end();
+      if (lease && response.is_str())
+        lease.resize(response.body().capacity());
       return *this;
     }
     
-    Http &post(const Form &form)
+    // Throws an HttpError unless the response code is 2xx or one of allowed.
+    Http &check_status(std::initializer_list<long> allowed = {})
+    {
+      if (response_code / 100 == 2 || std::find(allowed.begin(), allowed.end(), response_code) != allowed.end())
+        return *this;
+      std::string detail = "Unexpected response: Response code: " + std::to_string(response_code);
+      if (response.is_str())
+        detail += ", Response: \n" + std::string(response.str());
+      auto it = response.headers.find("retry-after");
+      throw HttpError(detail, classify(CURLE_OK, response_code),
+                      parse_retry_after(it == response.headers.end() ? "" : it->second));
+    }
+    
+    CURL *handle() { return curl; }
+    
+    const std::string &get_origin() const { return origin; }
+  
+  private:
+    // Where the time went: DNS, TCP connect, TLS, waiting for the first byte
+    // (server think-time) and receiving the rest. Times are in seconds.
+    void record(curl_off_t down, curl_off_t up)
+    {
+      curl_off_t dns = 0, connect = 0, tls = 0, pretransfer = 0, start = 0, total = 0;
+      curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME_T, &dns);
+      curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME_T, &connect);
+      curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME_T, &tls);
+      curl_easy_getinfo(curl, CURLINFO_PRETRANSFER_TIME_T, &pretransfer);
+      curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME_T, &start);
+      curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &total);
+      auto seconds = [](curl_off_t us) { return static_cast<double>(std::max<curl_off_t>(us, 0)) / 1e6; };
+      auto host = origin.substr(origin.find("://") == std::string::npos ? 0 : origin.find("://") + 3);
+      auto &series = HttpSeries::of(stage, host);
+      long version = 0;
+      curl_easy_getinfo(curl, CURLINFO_HTTP_VERSION, &version);
+      series.requests_of(response_code, version).add();
+      series.download.add(static_cast<double>(down));
+      series.decoded.add(static_cast<double>(response.decoded));
+      series.upload.add(static_cast<double>(up));
+      series.phases[HttpSeries::DNS].observe(seconds(dns));
+      series.phases[HttpSeries::Connect].observe(seconds(connect - dns));
+      series.phases[HttpSeries::TLS].observe(tls == 0 ? 0 : seconds(tls - connect));
+      series.phases[HttpSeries::Wait].observe(seconds(start - pretransfer));
+      series.phases[HttpSeries::Receive].observe(seconds(total - start));
+      series.total.observe(seconds(total));
+    }
+  
+  public:    
+    Http &prepare_post(const Form &form)
     {
       if (response.empty())
         set_str();
       curl_easy_setopt(curl, CURLOPT_POST, 1L);
-  
-      curl_mime *mime  = curl_mime_init(curl);
+      if (mime != nullptr)
+        curl_mime_free(mime);
+      mime = curl_mime_init(curl);
       curl_mimepart *part;
       for (auto &r: form)
       {
@@ -262,12 +820,209 @@ namespace sp
           }
       }
       curl_easy_setopt(curl, CURLOPT_MIMEPOST, mime);
-      auto cret = curl_easy_perform(curl);
-      sp::sp_assert(cret == CURLE_OK,
-                    "curl_easy_perform() failed: '" + std::string(curl_easy_strerror(cret)) + "'.");
-      curl_mime_free(mime);
       return *this;
     }
+    
+    // Posts data as the raw request body. The Content-Type is set with set_header().
+    Http &prepare_post_data(const std::string &data)
+    {
+      if (response.empty())
+        set_str();
+      curl_easy_setopt(curl, CURLOPT_POST, 1L);
+      curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, static_cast<curl_off_t>(data.size()));
+      curl_easy_setopt(curl, CURLOPT_COPYPOSTFIELDS, data.c_str());
+      return *this;
+    }
+    
+    Http &post_data(const std::string &data)
+    {
+      prepare_post_data(data);
+      return perform();
+    }
+    
+    // Adds a file part to the form set up by prepare_post(), read from relay
+    // while it is being filled. Blocks until the size of the body is known.
+    Http &add_part(const std::string &name, const std::string &filename, Relay &relay)
+    {
+      sp_assert(mime != nullptr, "No form.");
+      auto part = curl_mime_addpart(mime);
+      curl_mime_name(part, name.c_str());
+      curl_mime_filename(part, filename.c_str());
+      curl_mime_data_cb(part, relay.wait_length(), relay_read_callback, nullptr, nullptr, &relay);
+      return *this;
+    }
+    
+    Http &post(const Form &form)
+    {
+      prepare_post(form);
+      return perform();
+    }
+  };
+  
+  // Drives several prepared Http transfers concurrently on one curl multi handle.
+  // Transfers to the same host share one HTTP/2 connection, up to max_streams() at once.
+  // The multi handles, and with them their open connections, are reused by
+  // the next Multi on the same thread.
+  class Multi
+  {
+  private:
+    using Clock = std::chrono::steady_clock;
+    CURLM *multi;
+    std::map<CURL *, Http *> running;
+    std::multimap<Clock::time_point, Http *> throttled;// added once the RateLimiter allows
+    
+    struct Idle
+    {
+      std::vector<CURLM *> multis;
+      
+      ~Idle()
+      {
+        for (auto m: multis)
+          curl_multi_cleanup(m);
+      }
+    };
+    
+    static Idle &idle()
+    {
+      thread_local Idle idle;
+      return idle;
+    }
+    
+    static std::atomic<long> &streams()
+    {
+      static std::atomic<long> streams = 100;
+      return streams;
+    }
+  
+  public:
+    Multi()
+    {
+      auto &i = idle();
+      if (i.multis.empty())
+      {
+        CurlPool::get();// initializes libcurl
+        multi = curl_multi_init();
+        sp_assert(multi != nullptr, "curl_multi_init() failed");
+      }
+      else
+      {
+        multi = i.multis.back();
+        i.multis.pop_back();
+      }
+      multiplex(multi);
+    }
+    
+    Multi(const Multi &) = delete;
+    
+    ~Multi()
+    {
+      for (auto &r: running)
+        curl_multi_remove_handle(multi, r.first);
+      idle().multis.emplace_back(multi);
+    }
+    
+    // Streams per HTTP/2 connection. A host with more transfers than that gets another connection.
+    static void set_max_streams(long n) { streams() = std::max(n, 1L); }
+    
+    static long max_streams() { return streams(); }
+    
+    // Lets the transfers on multi share HTTP/2 connections.
+    static void multiplex(CURLM *multi)
+    {
+      curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+      curl_multi_setopt(multi, CURLMOPT_MAX_CONCURRENT_STREAMS, max_streams());
+    }
+    
+    // A transfer the RateLimiter holds back starts later, in wait(), instead of
+    // blocking the transfers already running.
+    Multi &add(Http &h)
+    {
+      auto delay = RateLimiter::get().reserve(h.get_origin());
+      if (delay.count() > 0)
+        throttled.emplace(Clock::now() + std::chrono::duration_cast<Clock::duration>(delay), &h);
+      else
+        start(h);
+      return *this;
+    }
+    
+    // Cancels a transfer that has not finished yet.
+    Multi &remove(Http &h)
+    {
+      if (running.erase(h.handle()) != 0)
+        curl_multi_remove_handle(multi, h.handle());
+      std::erase_if(throttled, [&h](auto &t) { return t.second == &h; });
+      return *this;
+    }
+    
+    [[nodiscard]] std::size_t size() const { return running.size() + throttled.size(); }
+    
+    [[nodiscard]] bool empty() const { return running.empty() && throttled.empty(); }
+    
+    // Runs every added transfer to the end. Throws on the first failed one.
+    Multi &perform_all()
+    {
+      while (!empty())
+      {
+        for (auto &[h, cret]: wait())
+          check_curl(cret);
+      }
+      return *this;
+    }
+    
+    // Blocks until at least one transfer finishes, and returns every finished one.
+    std::vector<std::pair<Http *, CURLcode>> wait()
+    {
+      std::vector<std::pair<Http *, CURLcode>> done;
+      while (done.empty() && !empty())
+      {
+        auto now = Clock::now();
+        while (!throttled.empty() && throttled.begin()->first <= now)
+        {
+          start(*throttled.begin()->second);
+          throttled.erase(throttled.begin());
+        }
+        if (running.empty())
+        {
+          std::this_thread::sleep_until(throttled.begin()->first);
+          continue;
+        }
+        int still_running = 0;
+        auto mret = curl_multi_perform(multi, &still_running);
+        sp_assert(mret == CURLM_OK,
+                  "curl_multi_perform() failed: '" + std::string(curl_multi_strerror(mret)) + "'.");
+        int left = 0;
+        while (CURLMsg *msg = curl_multi_info_read(multi, &left))
+        {
+          if (msg->msg != CURLMSG_DONE) continue;
+          auto it = running.find(msg->easy_handle);
+          if (it == running.end()) continue;
+          auto cret = msg->data.result;
+          auto h = it->second;
+          running.erase(it);
+          curl_multi_remove_handle(multi, h->handle());
+          h->finish();
+          done.emplace_back(h, cret);
+        }
+        if (done.empty() && still_running != 0)
+        {
+          auto timeout = std::chrono::milliseconds(1000);
+          if (!throttled.empty())
+            timeout = std::clamp(std::chrono::ceil<std::chrono::milliseconds>(throttled.begin()->first - now),
+                                 std::chrono::milliseconds(0), timeout);
+          curl_multi_poll(multi, nullptr, 0, static_cast<int>(timeout.count()), nullptr);
+        }
+      }
+      return done;
+    }
+  
+  private:
+    void start(Http &h)
+    {
+      auto mret = curl_multi_add_handle(multi, h.handle());
+      sp_assert(mret == CURLM_OK,
+                "curl_multi_add_handle() failed: '" + std::string(curl_multi_strerror(mret)) + "'.");
+      running[h.handle()] = &h;
+    }
   };
 }
 #endif
\ No newline at end of file
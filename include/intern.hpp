@@ -0,0 +1,68 @@
+//   Copyright 2023 sotpider - caozhanhao
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+#ifndef SOTPIDER_INTERN_HPP
+#define SOTPIDER_INTERN_HPP
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <shared_mutex>
+#include <mutex>
+namespace sp
+{
+  // One copy of every user name, search id, tag and url prefix, shared by all posts.
+  // Interned strings live as long as the process, so only strings from a small,
+  // repeating set belong here.
+  class Interner
+  {
+  private:
+    struct Hash
+    {
+      using is_transparent = void;
+      
+      std::size_t operator()(std::string_view str) const { return std::hash<std::string_view>{}(str); }
+    };
+    
+    std::shared_mutex mtx;
+    std::unordered_set<std::string, Hash, std::equal_to<>> strings;// nodes never move
+    
+    Interner() = default;
+  
+  public:
+    Interner(const Interner &) = delete;
+    
+    static Interner &get()
+    {
+      static Interner interner;
+      return interner;
+    }
+    
+    std::string_view intern(std::string_view str)
+    {
+      if (str.empty()) return {};
+      {
+        std::shared_lock l(mtx);
+        if (auto it = strings.find(str); it != strings.end()) return *it;
+      }
+      std::unique_lock l(mtx);
+      return *strings.emplace(str).first;
+    }
+    
+    std::size_t size()
+    {
+      std::shared_lock l(mtx);
+      return strings.size();
+    }
+  };
+}
+#endif
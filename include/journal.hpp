@@ -0,0 +1,183 @@
+//   Copyright 2023 sotpider - caozhanhao
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+#ifndef SOTPIDER_JOURNAL_HPP
+#define SOTPIDER_JOURNAL_HPP
+#include "error.hpp"
+#include <string>
+#include <set>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+namespace sp
+{
+  // Append-only record of finished work, one line per record:
+  //   page <search id> <page>       every post of the page has been uploaded
+  //   post <post key> <wordpress id>
+  // Records are written and fsync()ed in batches, either every `batch` records
+  // or every `interval`, whichever comes first. A crash loses at most one batch,
+  // which is simply done again. A torn last line is cut off on load.
+  class Journal
+  {
+  private:
+    std::string path;
+    int fd;
+    std::set<std::pair<std::string, std::size_t>> pages;
+    std::map<std::string, int> posts;
+    std::string pending;
+    std::size_t pending_records;
+    std::size_t batch;
+    std::chrono::milliseconds interval;
+    std::mutex mtx;
+    std::mutex io_mtx;
+    std::condition_variable cv;
+    bool stopping;
+    std::thread flusher;
+  public:
+    Journal(std::string path_, std::size_t batch_ = 64,
+            std::chrono::milliseconds interval_ = std::chrono::milliseconds(1000))
+        : path(std::move(path_)), fd(-1), pending_records(0), batch(batch_ == 0 ? 1 : batch_),
+          interval(interval_), stopping(false)
+    {
+      auto intact = load();
+      fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+      sp_assert(fd != -1, "Open journal '" + path + "' failed.");
+      // Completing the torn line instead could turn "page x 12" cut short into a record of page 1.
+      struct stat st{};
+      if (::fstat(fd, &st) == 0 && static_cast<std::size_t>(st.st_size) > intact)
+        sp_assert(::ftruncate(fd, static_cast<off_t>(intact)) == 0, "Truncating journal '" + path + "' failed.");
+      flusher = std::thread([this]
+                            {
+                              std::unique_lock l(mtx);
+                              while (!stopping)
+                              {
+                                cv.wait_for(l, interval);
+                                flush_locked(l);
+                              }
+                            });
+    }
+    
+    Journal(const Journal &) = delete;
+    
+    ~Journal()
+    {
+      {
+        std::lock_guard l(mtx);
+        stopping = true;
+        cv.notify_all();
+      }
+      flusher.join();
+      std::unique_lock l(mtx);
+      flush_locked(l);
+      ::close(fd);
+    }
+    
+    bool page_done(const std::string &id, std::size_t page)
+    {
+      std::lock_guard l(mtx);
+      return pages.count({id, page}) != 0;
+    }
+    
+    bool post_done(const std::string &key)
+    {
+      std::lock_guard l(mtx);
+      return posts.count(key) != 0;
+    }
+    
+    void finish_page(const std::string &id, std::size_t page)
+    {
+      std::unique_lock l(mtx);
+      if (!pages.insert({id, page}).second) return;
+      append(l, "page " + id + " " + std::to_string(page) + "\n");
+    }
+    
+    void finish_post(const std::string &key, int wordpress_id)
+    {
+      std::unique_lock l(mtx);
+      posts[key] = wordpress_id;
+      append(l, "post " + key + " " + std::to_string(wordpress_id) + "\n");
+    }
+    
+    void sync()
+    {
+      std::unique_lock l(mtx);
+      flush_locked(l);
+    }
+  
+  private:
+    // Returns the size of the intact records, which a torn last line follows.
+    std::size_t load()
+    {
+      std::ifstream in(path);
+      std::string line;
+      std::size_t intact = 0;
+      while (std::getline(in, line))
+      {
+        if (in.eof()) break;// no newline: the write was torn
+        intact += line.size() + 1;
+        std::istringstream ss(line);
+        std::string kind, key;
+        long long value;
+        if (!(ss >> kind >> key >> value)) continue;
+        if (kind == "page")
+          pages.insert({key, static_cast<std::size_t>(value)});
+        else if (kind == "post")
+          posts[key] = static_cast<int>(value);
+      }
+      return intact;
+    }
+    
+    void append(std::unique_lock<std::mutex> &l, const std::string &record)
+    {
+      pending += record;
+      if (++pending_records >= batch)
+        flush_locked(l);
+    }
+    
+    // Called with mtx held. The records are written and synced after it is released,
+    // so lookups from other workers are not blocked on the disk.
+    void flush_locked(std::unique_lock<std::mutex> &l)
+    {
+      if (pending.empty()) return;
+      std::string records;
+      records.swap(pending);
+      pending_records = 0;
+      std::lock_guard io(io_mtx);
+      l.unlock();
+      std::size_t written = 0;
+      while (written < records.size())
+      {
+        auto n = ::write(fd, records.data() + written, records.size() - written);
+        if (n < 0)
+        {
+          std::cerr << "\033[0;32;31mError: \033[mWriting journal '" << path << "' failed." << std::endl;
+          l.lock();
+          pending.insert(0, records, written);// keep the rest, try again on the next flush
+          return;
+        }
+        written += static_cast<std::size_t>(n);
+      }
+      ::fsync(fd);
+      l.lock();
+    }
+  };
+}
+#endif
\ No newline at end of file
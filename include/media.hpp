@@ -0,0 +1,158 @@
+//   Copyright 2023 sotpider - caozhanhao
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+#ifndef SOTPIDER_MEDIA_HPP
+#define SOTPIDER_MEDIA_HPP
+#include "error.hpp"
+#include <string>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <fstream>
+#include <iostream>
+namespace sp
+{
+  // Media already on the server, by the Hash64 of its bytes. Appended to a file of
+  // "<hash>\t<media id>\t<rendered html>" lines, with '\\', '\t', '\r' and '\n'
+  // in the html escaped. A torn or malformed line is ignored on load.
+  class MediaIndex
+  {
+  private:
+    std::string path;
+    std::map<std::string, std::pair<int, std::string>> medias;
+    std::ofstream out;
+    std::mutex mtx;
+  public:
+    explicit MediaIndex(std::string path_) : path(std::move(path_))
+    {
+      std::ifstream in(path);
+      std::string line;
+      bool torn = false;
+      while (std::getline(in, line))
+      {
+        if (in.eof())// no newline: the write was torn
+        {
+          torn = !line.empty();
+          break;
+        }
+        auto tab1 = line.find('\t');
+        if (tab1 == std::string::npos || tab1 == 0) continue;
+        auto tab2 = line.find('\t', tab1 + 1);
+        if (tab2 == std::string::npos) continue;
+        try
+        {
+          medias[line.substr(0, tab1)] = {std::stoi(line.substr(tab1 + 1, tab2 - tab1 - 1)),
+                                          unescape(line.substr(tab2 + 1))};
+        }
+        catch (std::logic_error &)
+        {
+          continue;
+        }
+      }
+      in.close();
+      out.open(path, std::ios_base::out | std::ios_base::app | std::ios_base::binary);
+      sp_assert(out.is_open(), "Open media index '" + path + "' failed.");
+      if (torn)
+        out << '\n';// terminate the torn record, so the next one starts on its own line
+    }
+    
+    MediaIndex(const MediaIndex &) = delete;
+    
+    std::optional<std::pair<int, std::string>> find(const std::string &hash)
+    {
+      std::lock_guard l(mtx);
+      auto it = medias.find(hash);
+      if (it == medias.end()) return std::nullopt;
+      return it->second;
+    }
+    
+    void add(const std::string &hash, int media_id, const std::string &html)
+    {
+      std::lock_guard l(mtx);
+      if (!medias.emplace(hash, std::make_pair(media_id, html)).second) return;
+      out << hash << '\t' << media_id << '\t' << escape(html) << '\n';
+      out.flush();
+      if (!out.good())
+      {
+        std::cerr << "\033[0;32;31mError: \033[mWriting media index '" << path << "' failed." << std::endl;
+        out.clear();
+      }
+    }
+    
+    std::size_t size()
+    {
+      std::lock_guard l(mtx);
+      return medias.size();
+    }
+  
+  private:
+    static std::string escape(const std::string &str)
+    {
+      std::string ret;
+      ret.reserve(str.size());
+      for (auto c: str)
+      {
+        switch (c)
+        {
+          case '\\':
+            ret += "\\\\";
+            break;
+          case '\t':
+            ret += "\\t";
+            break;
+          case '\r':
+            ret += "\\r";
+            break;
+          case '\n':
+            ret += "\\n";
+            break;
+          default:
+            ret += c;
+            break;
+        }
+      }
+      return ret;
+    }
+    
+    static std::string unescape(const std::string &str)
+    {
+      std::string ret;
+      ret.reserve(str.size());
+      for (std::size_t i = 0; i < str.size(); ++i)
+      {
+        if (str[i] != '\\' || i + 1 == str.size())
+        {
+          ret += str[i];
+          continue;
+        }
+        switch (str[++i])
+        {
+          case 't':
+            ret += '\t';
+            break;
+          case 'r':
+            ret += '\r';
+            break;
+          case 'n':
+            ret += '\n';
+            break;
+          default:
+            ret += str[i];
+            break;
+        }
+      }
+      return ret;
+    }
+  };
+}
+#endif
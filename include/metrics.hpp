@@ -0,0 +1,370 @@
+//   Copyright 2023 sotpider - caozhanhao
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+#ifndef SOTPIDER_METRICS_HPP
+#define SOTPIDER_METRICS_HPP
+#include "error.hpp"
+#include <rapidjson/stringbuffer.h>
+#include <rapidjson/writer.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <filesystem>
+#include <limits>
+#include <algorithm>
+namespace sp
+{
+  // Process-wide counters and histograms, each series identified by its name and labels.
+  // A hot path resolves its series once with counter() or histogram() and updates them
+  // with atomics, add() and observe() look the series up on every call.
+  // Can be written out every `interval` as Prometheus text or JSON, see start_export().
+  class Metrics
+  {
+  public:
+    using Labels = std::vector<std::pair<std::string, std::string>>;
+    enum class Format { Prometheus, Json };
+    struct Summary
+    {
+      Labels labels;
+      std::uint64_t count;
+      double sum;
+      std::vector<double> bounds;
+      std::vector<std::uint64_t> buckets;// not cumulative, the last one is above every bound
+      
+      // The upper bound of the bucket holding the q-quantile, +inf if above every bucket.
+      double quantile(double q) const
+      {
+        std::uint64_t seen = 0;
+        for (std::size_t i = 0; i < bounds.size(); ++i)
+        {
+          seen += buckets[i];
+          if (static_cast<double>(seen) >= q * static_cast<double>(count)) return bounds[i];
+        }
+        return std::numeric_limits<double>::infinity();
+      }
+    };
+  private:
+    struct Series
+    {
+      Labels labels;
+      bool histogram;
+      std::atomic<double> sum = 0;// the value of a counter
+      std::atomic<std::uint64_t> count = 0;
+      std::unique_ptr<std::atomic<std::uint64_t>[]> buckets;// not cumulative
+    };
+  
+  public:
+    // A counter series, see counter().
+    class Counter
+    {
+    private:
+      friend class Metrics;
+      Series *series = nullptr;
+    public:
+      void add(double value = 1) const
+      {
+        if (series != nullptr)
+          series->sum.fetch_add(value, std::memory_order_relaxed);
+      }
+    };
+    
+    // A histogram series, see histogram().
+    class Histogram
+    {
+    private:
+      friend class Metrics;
+      Series *series = nullptr;
+      const std::vector<double> *bounds = nullptr;
+    public:
+      void observe(double value) const
+      {
+        if (series == nullptr) return;
+        series->sum.fetch_add(value, std::memory_order_relaxed);
+        series->count.fetch_add(1, std::memory_order_relaxed);
+        auto i = std::lower_bound(bounds->begin(), bounds->end(), value) - bounds->begin();
+        series->buckets[i].fetch_add(1, std::memory_order_relaxed);
+      }
+    };
+  
+  private:
+    std::mutex mtx;// guards the maps, not the values
+    std::map<std::string, std::map<std::string, std::unique_ptr<Series>>> series;// name -> {labels} -> series
+    const std::vector<double> bounds;// upper bounds of the histogram buckets, in seconds
+    
+    std::mutex export_mtx;
+    std::condition_variable cv;
+    std::thread exporter;
+    bool stopping;
+    
+    Metrics() : bounds{0.001, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60, 120},
+                stopping(false) {}
+  
+  public:
+    Metrics(const Metrics &) = delete;
+    
+    ~Metrics() { stop_export(); }
+    
+    static Metrics &get()
+    {
+      static Metrics metrics;
+      return metrics;
+    }
+    
+    // The series of name and labels. It lives as long as the Metrics.
+    Counter counter(const std::string &name, const Labels &labels)
+    {
+      Counter ret;
+      ret.series = &of(name, labels, false);
+      return ret;
+    }
+    
+    Histogram histogram(const std::string &name, const Labels &labels)
+    {
+      Histogram ret;
+      ret.series = &of(name, labels, true);
+      ret.bounds = &bounds;
+      return ret;
+    }
+    
+    void add(const std::string &name, const Labels &labels, double value = 1)
+    {
+      counter(name, labels).add(value);
+    }
+    
+    void observe(const std::string &name, const Labels &labels, double value)
+    {
+      histogram(name, labels).observe(value);
+    }
+    
+    // Every series of the histogram name.
+    std::vector<Summary> histograms(const std::string &name)
+    {
+      std::lock_guard l(mtx);
+      std::vector<Summary> ret;
+      auto it = series.find(name);
+      if (it == series.end()) return ret;
+      for (auto &[key, s]: it->second)
+        if (s->histogram)
+          ret.push_back({s->labels, s->count.load(), s->sum.load(), bounds, buckets_of(*s)});
+      return ret;
+    }
+    
+    // One group per metric name: its # TYPE line, then every series of it.
+    void write_prometheus(std::ostream &out)
+    {
+      std::lock_guard l(mtx);
+      out.precision(15);
+      for (auto &[name, group]: series)
+      {
+        if (group.empty()) continue;
+        out << "# TYPE " << name << (group.begin()->second->histogram ? " histogram\n" : " counter\n");
+        for (auto &[key, s]: group)
+        {
+          if (!s->histogram)
+          {
+            out << name << key << ' ' << s->sum.load() << '\n';
+            continue;
+          }
+          std::uint64_t cumulative = 0;
+          auto buckets = buckets_of(*s);
+          for (std::size_t i = 0; i <= bounds.size(); ++i)
+          {
+            cumulative += buckets[i];
+            std::ostringstream le;
+            if (i == bounds.size())
+              le << "+Inf";
+            else
+              le << bounds[i];
+            auto labels = s->labels;
+            labels.emplace_back("le", le.str());
+            out << name << "_bucket" << render(labels) << ' ' << cumulative << '\n';
+          }
+          out << name << "_sum" << key << ' ' << s->sum.load() << '\n';
+          out << name << "_count" << key << ' ' << s->count.load() << '\n';
+        }
+      }
+    }
+    
+    void write_json(std::ostream &out)
+    {
+      rapidjson::StringBuffer buffer;
+      rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+      writer.StartObject();
+      writer.Key("time");
+      writer.Int64(std::chrono::duration_cast<std::chrono::milliseconds>
+                       (std::chrono::system_clock::now().time_since_epoch()).count());
+      writer.Key("metrics");
+      writer.StartArray();
+      {
+        std::lock_guard l(mtx);
+        for (auto &[name, group]: series)
+        {
+          for (auto &[key, s]: group)
+          {
+            writer.StartObject();
+            writer.Key("name");
+            writer.String(name.c_str());
+            writer.Key("type");
+            writer.String(s->histogram ? "histogram" : "counter");
+            writer.Key("labels");
+            writer.StartObject();
+            for (auto &[k, v]: s->labels)
+            {
+              writer.Key(k.c_str());
+              writer.String(v.c_str(), static_cast<rapidjson::SizeType>(v.size()));
+            }
+            writer.EndObject();
+            if (!s->histogram)
+            {
+              writer.Key("value");
+              writer.Double(s->sum.load());
+              writer.EndObject();
+              continue;
+            }
+            writer.Key("count");
+            writer.Uint64(s->count.load());
+            writer.Key("sum");
+            writer.Double(s->sum.load());
+            writer.Key("buckets");
+            writer.StartArray();
+            for (std::size_t i = 0; i < bounds.size(); ++i)
+              writer.Double(bounds[i]);
+            writer.EndArray();
+            writer.Key("counts");// counts[i] values are <= buckets[i], the last one is above them all
+            writer.StartArray();
+            for (auto c: buckets_of(*s))
+              writer.Uint64(c);
+            writer.EndArray();
+            writer.EndObject();
+          }
+        }
+      }
+      writer.EndArray();
+      writer.EndObject();
+      out.write(buffer.GetString(), static_cast<std::streamsize>(buffer.GetSize()));
+      out << '\n';
+    }
+    
+    // Replaces the file at path with the current metrics every interval, and once more on stop_export().
+    void start_export(const std::string &path, Format format, std::chrono::milliseconds interval)
+    {
+      stop_export();
+      std::lock_guard l(export_mtx);
+      stopping = false;
+      exporter = std::thread([this, path, format, interval]
+                             {
+                               std::unique_lock l(export_mtx);
+                               while (true)
+                               {
+                                 bool last = cv.wait_for(l, interval, [this] { return stopping; });
+                                 l.unlock();
+                                 write_file(path, format);
+                                 l.lock();
+                                 if (last) return;
+                               }
+                             });
+    }
+    
+    void stop_export()
+    {
+      {
+        std::lock_guard l(export_mtx);
+        stopping = true;
+        cv.notify_all();
+      }
+      if (exporter.joinable())
+        exporter.join();
+    }
+  
+  private:
+    Series &of(const std::string &name, const Labels &labels, bool histogram)
+    {
+      std::lock_guard l(mtx);
+      auto &s = series[name][render(labels)];
+      if (s == nullptr)
+      {
+        s = std::make_unique<Series>();
+        s->labels = labels;
+        s->histogram = histogram;
+        if (histogram)
+        {
+          s->buckets = std::make_unique<std::atomic<std::uint64_t>[]>(bounds.size() + 1);
+          for (std::size_t i = 0; i <= bounds.size(); ++i)
+            s->buckets[i] = 0;
+        }
+      }
+      return *s;
+    }
+    
+    // A snapshot of the buckets of a histogram.
+    std::vector<std::uint64_t> buckets_of(const Series &s) const
+    {
+      std::vector<std::uint64_t> ret(bounds.size() + 1);
+      for (std::size_t i = 0; i < ret.size(); ++i)
+        ret[i] = s.buckets[i].load(std::memory_order_relaxed);
+      return ret;
+    }
+    
+    static std::string render(const Labels &labels)
+    {
+      if (labels.empty()) return "";
+      std::string ret = "{";
+      for (auto &[k, v]: labels)
+      {
+        ret += k + "=\"";
+        for (auto c: v)
+        {
+          if (c == '\\' || c == '"') ret += '\\';
+          if (c == '\n')
+          {
+            ret += "\\n";
+            continue;
+          }
+          ret += c;
+        }
+        ret += "\",";
+      }
+      ret.back() = '}';
+      return ret;
+    }
+    
+    void write_file(const std::string &path, Format format)
+    {
+      auto tmp = path + ".tmp";
+      {
+        std::ofstream out(tmp, std::ios_base::out | std::ios_base::trunc);
+        if (!out.is_open())
+        {
+          std::cerr << "\033[0;32;31mError: \033[mWriting metrics '" << tmp << "' failed." << std::endl;
+          return;
+        }
+        if (format == Format::Json)
+          write_json(out);
+        else
+          write_prometheus(out);
+      }
+      std::error_code ec;
+      std::filesystem::rename(tmp, path, ec);
+    }
+  };
+}
+#endif
@@ -0,0 +1,509 @@
+//   Copyright 2023 sotpider - caozhanhao
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+#ifndef SOTPIDER_PIPELINE_HPP
+#define SOTPIDER_PIPELINE_HPP
+#include "error.hpp"
+#include "post.hpp"
+#include "uploader.h"
+#include "journal.hpp"
+#include "batch.hpp"
+#include "watermark.hpp"
+#include "retry.hpp"
+#include "metrics.hpp"
+#include "spill.hpp"
+#include "budget.hpp"
+#include "schedule.hpp"
+#include <string>
+#include <vector>
+#include <deque>
+#include <optional>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <algorithm>
+#include <filesystem>
+namespace sp
+{
+  // A blocking queue with a fixed capacity, so a fast stage waits for a slow one.
+  template<typename T>
+  class BoundedQueue
+  {
+  private:
+    std::mutex mtx;
+    std::condition_variable not_empty;
+    std::condition_variable not_full;
+    std::deque<T> items;
+    std::size_t capacity;
+    bool closed;
+  public:
+    explicit BoundedQueue(std::size_t capacity_) : capacity(capacity_ == 0 ? 1 : capacity_), closed(false) {}
+    
+    // Returns false if the queue has been closed.
+    bool push(T item)
+    {
+      std::unique_lock l(mtx);
+      not_full.wait(l, [this] { return closed || items.size() < capacity; });
+      if (closed) return false;
+      items.emplace_back(std::move(item));
+      not_empty.notify_one();
+      return true;
+    }
+    
+    // Returns std::nullopt once the queue is closed and drained.
+    std::optional<T> pop()
+    {
+      std::unique_lock l(mtx);
+      not_empty.wait(l, [this] { return closed || !items.empty(); });
+      if (items.empty()) return std::nullopt;
+      auto item = std::move(items.front());
+      items.pop_front();
+      not_full.notify_one();
+      return item;
+    }
+    
+    void close()
+    {
+      std::lock_guard l(mtx);
+      closed = true;
+      not_empty.notify_all();
+      not_full.notify_all();
+    }
+  };
+  
+  struct PipelineConfig
+  {
+    std::string from_server;
+    std::string download_server;
+    std::string to_server;
+    std::string username;
+    std::string password;
+    int timeout = -1;
+    std::pair<int, int> page_range{1, -1};
+    std::size_t fetch_concurrency = 1;
+    std::size_t fetch_workers = 1;
+    std::size_t download_workers = 1;
+    std::size_t upload_workers = 1;
+    std::size_t queue_size = 16;
+    std::string spill;// empty: fetching waits for queue_size posts to be downloaded
+    std::size_t spill_budget = 64 << 20;// bytes of fetched posts kept in memory before spilling
+    std::size_t relay_buffer = 0;
+    std::size_t download_ranges = 1;// parallel ranges for a large media file, 1: one stream
+    long long range_threshold = 64 << 20;// bytes, smallest media file worth splitting
+    std::string journal;// empty: no journal
+    std::string tags_cache;// empty: not persisted
+    std::string media_index;// empty: every media is uploaded
+    std::size_t tags_warm = 0;// pages fetched at once when warming the tag cache, 0: no warming
+    std::size_t batch_size = 0;// posts per /batch/v1 request, 0: one request per post
+    int batch_interval = 2000;// ms a post waits at most for its batch to fill
+    bool incremental = false;// stop at the newest post of the last run
+    std::string state = "sotpider.state";// where the newest posts are kept
+    std::size_t max_attempts = 0;// per step, 0: no limit
+    int backoff_base = 500;// ms
+    int backoff_cap = 60000;// ms
+    double rate_limit = 0;// requests per second to each host, 0: no limit
+    double bandwidth_limit = 0;// bytes per second from and to each host, 0: no limit
+    long max_streams = 100;// concurrent HTTP/2 streams per connection
+    std::string metrics;// empty: not exported
+    Metrics::Format metrics_format = Metrics::Format::Prometheus;
+    int metrics_interval = 10000;// ms
+    std::size_t memory_budget = 0;// MiB of page bodies and relay buffers at once, 0: no limit
+    std::size_t disk_budget = 0;// MiB of media staged for upload at once, 0: no limit
+    int progress_interval = 250;// ms between redraws of the status line, 0: no status line
+    int recrawl_interval = 0;// s between two crawls of a search id, 0: crawl once and exit
+    int recrawl_jitter = 0;// s a crawl may start earlier or later
+  };
+  
+  // fetch -> download -> upload, each stage with its own workers.
+  // A failed step is reported and retried with backoff, without blocking the other stages.
+  // A post whose step fails for good is skipped, and left for the next run.
+  class Pipeline
+  {
+  private:
+    struct Staged
+    {
+      Post post;
+      std::vector<std::string> paths;
+      Budget::Lease disk;// for the files at paths
+    };
+    
+    PipelineConfig config;
+    Backoff backoff;
+    Uploader uploader;
+    SpillQueue fetched;
+    BoundedQueue<Staged> downloaded;
+    std::unique_ptr<Journal> journal;
+    std::unique_ptr<PostBatcher> batcher;
+    std::mutex pages_mtx;
+    std::map<std::pair<std::string, std::size_t>, std::size_t> unfinished_pages;// -> posts not uploaded yet
+    struct Crawl
+    {
+      std::size_t outstanding = 0;// posts not uploaded yet
+      bool fetched = false;
+      bool failed = false;// the crawl gave up before reaching its end, or skipped a post
+      std::string newest;
+    };
+    std::unique_ptr<WaterMarks> marks;
+    std::map<std::string, Crawl> crawls;// guarded by pages_mtx
+    std::atomic<std::size_t> staged_bytes = 0;
+    std::atomic<std::size_t> staged_files = 0;
+    Schedule schedule;
+  public:
+    explicit Pipeline(PipelineConfig config_)
+        : config(std::move(config_)),
+          backoff{std::chrono::milliseconds(config.backoff_base), std::chrono::milliseconds(config.backoff_cap)},
+          uploader(config.to_server, config.username, config.password, config.timeout),
+          fetched(config.queue_size, config.spill, config.spill_budget), downloaded(config.queue_size)
+    {
+      RateLimiter::get().set_default(config.rate_limit, config.bandwidth_limit);
+      Budget::memory().set_limit(config.memory_budget << 20);
+      Budget::disk().set_limit(config.disk_budget << 20);
+      Progress::get().start(std::chrono::milliseconds(config.progress_interval));
+      Multi::set_max_streams(config.max_streams);
+      CurlPool::get().set_max_idle(std::max({config.fetch_workers * config.fetch_concurrency,
+                                              config.download_workers * config.download_ranges,
+                                              config.upload_workers}));
+      uploader.set_relay(config.relay_buffer);
+      uploader.set_ranges(config.download_ranges, config.range_threshold);
+      if (!config.journal.empty())
+        journal = std::make_unique<Journal>(config.journal);
+      if (!config.tags_cache.empty())
+        uploader.set_tags_cache(config.tags_cache);
+      if (!config.media_index.empty())
+        uploader.set_media_index(config.media_index);
+      if (config.incremental)
+        marks = std::make_unique<WaterMarks>(config.state);
+      if (config.batch_size != 0)
+        batcher = std::make_unique<PostBatcher>(uploader, config.batch_size,
+                                                std::chrono::milliseconds(config.batch_interval),
+                                                backoff, config.max_attempts);
+      if (!config.metrics.empty())
+        Metrics::get().start_export(config.metrics, config.metrics_format,
+                                    std::chrono::milliseconds(config.metrics_interval));
+    }
+    
+    Pipeline(const Pipeline &) = delete;
+    
+    ~Pipeline()
+    {
+      Progress::get().stop();
+      if (!config.metrics.empty())
+        Metrics::get().stop_export();
+    }
+    
+    void run(const std::vector<std::string> &ids)
+    {
+      std::atomic<std::size_t> id_pos = 0;
+      run_stages([this, &ids, &id_pos]
+                 {
+                   for (auto pos = id_pos++; pos < ids.size(); pos = id_pos++)
+                     fetch(ids[pos]);
+                 });
+    }
+    
+    // Stays resident and crawls every id again every recrawl_interval, see Schedule.
+    // Connections, caches, watermarks and the workers of every stage live on between
+    // crawls. Returns after stop(), once what has been fetched is uploaded.
+    void serve(const std::vector<std::string> &ids)
+    {
+      if (marks == nullptr && journal == nullptr)
+        std::cerr << "Neither incremental nor journal is set, every crawl uploads every post again." << std::endl;
+      schedule.start(ids, std::chrono::seconds(config.recrawl_interval), std::chrono::seconds(config.recrawl_jitter));
+      run_stages([this]
+                 {
+                   while (auto crawl = schedule.next())
+                   {
+                     if (crawling(crawl->id))
+                     {
+                       // the last crawl is still being uploaded, its mark has not moved yet
+                       schedule.postpone(*crawl, std::chrono::seconds(10));
+                       continue;
+                     }
+                     fetch(crawl->id, crawl->round == 0);
+                     Metrics::get().add("sotpider_crawls_total", {});
+                     schedule.done(*crawl);
+                   }
+                 });
+    }
+    
+    // Ends serve(). Safe to call from any thread.
+    void stop()
+    {
+      schedule.close();
+    }
+  
+  private:
+    // Runs fetch_worker on fetch_workers threads along with the other stages,
+    // and drains the stages once every fetch_worker has returned.
+    void run_stages(const std::function<void()> &fetch_worker)
+    {
+      std::vector<std::thread> fetchers, downloaders, uploaders;
+      std::thread warmer;
+      if (config.tags_warm != 0)
+      {
+        // Runs alongside the first fetches. Lookups in the meantime just miss the cache.
+        warmer = std::thread([this]
+                             {
+                               try
+                               {
+                                 uploader.warm_tags(config.tags_warm);
+                               }
+                               catch (sp::Error &e)
+                               {
+                                 std::cerr << e.get_content() << std::endl;
+                               }
+                               catch (...)
+                               {
+                                 std::cerr << "Unexpected Error." << std::endl;
+                               }
+                             });
+      }
+      for (std::size_t i = 0; i < std::max<std::size_t>(config.fetch_workers, 1); ++i)
+        fetchers.emplace_back(fetch_worker);
+      for (std::size_t i = 0; i < std::max<std::size_t>(config.download_workers, 1); ++i)
+        downloaders.emplace_back([this] { download(); });
+      for (std::size_t i = 0; i < std::max<std::size_t>(config.upload_workers, 1); ++i)
+        uploaders.emplace_back([this] { upload(); });
+      
+      for (auto &t: fetchers) t.join();
+      fetched.close();
+      for (auto &t: downloaders) t.join();
+      downloaded.close();
+      for (auto &t: uploaders) t.join();
+      if (batcher != nullptr)
+        batcher->close();
+      if (warmer.joinable()) warmer.join();
+    }
+    
+    // resume: skip the pages the journal has as done. Only for the first crawl of id,
+    // a later one looks for new posts on pages that were done before.
+    void fetch(const std::string &id, bool resume = true)
+    {
+      PostGetter getter{config.from_server, config.download_server, config.timeout, config.fetch_concurrency};
+      if (journal != nullptr && resume)
+        getter.set_skip([this](const std::string &id, size_t page) { return journal->page_done(id, page); });
+      std::string mark = marks == nullptr ? "" : marks->get(id);
+      if (!mark.empty())
+      {
+        // Posts come newest first. The last one is checked, not the first,
+        // because a pinned post may be older than everything after it.
+        getter.set_stop([&mark](const std::string &, const std::vector<Post> &posts)
+                        {
+                          return !posts.empty() && !posts.back().get_id().empty()
+                                 && !newer_id(posts.back().get_id(), mark);
+                        });
+      }
+      auto range = config.page_range;
+      bool ok = retry([&]
+                      {
+                        if (range.second != -1 && range.first >= range.second) return;
+                        getter.fetch_video(id, range, [this, &id, &range, &mark](size_t page, std::vector<Post> &&posts)
+                        {
+                          if (marks != nullptr)
+                          {
+                            std::lock_guard l(pages_mtx);
+                            auto &crawl = crawls[id];
+                            for (auto &p: posts)
+                              if (!p.get_id().empty() && (crawl.newest.empty() || newer_id(p.get_id(), crawl.newest)))
+                                crawl.newest = p.get_id();
+                          }
+                          if (!mark.empty())
+                            std::erase_if(posts, [&mark](auto &p)
+                                { return !p.get_id().empty() && !newer_id(p.get_id(), mark); });
+                          if (journal != nullptr)
+                          {
+                            std::erase_if(posts, [this](auto &p) { return journal->post_done(p.get_key()); });
+                            if (posts.empty())
+                              journal->finish_page(id, page);
+                            else
+                            {
+                              std::lock_guard l(pages_mtx);
+                              unfinished_pages[{id, page}] = posts.size();
+                            }
+                          }
+                          if (marks != nullptr)
+                          {
+                            std::lock_guard l(pages_mtx);
+                            crawls[id].outstanding += posts.size();
+                          }
+                          Metrics::get().add("sotpider_posts_total", {{"stage", "fetched"}},
+                                             static_cast<double>(posts.size()));
+                          for (auto &p: posts)
+                            fetched.push(std::move(p));
+                          range.first = static_cast<int>(page) + 1;// resume after the last finished page
+                        });
+                      });
+      if (!ok)
+        std::cerr << "Gave up fetching " << id << " at page " << range.first << "." << std::endl;
+      if (marks != nullptr)
+      {
+        std::lock_guard l(pages_mtx);
+        crawls[id].fetched = true;
+        crawls[id].failed |= !ok;// a skipped post may have failed it already
+        advance_mark(id);
+      }
+    }
+    
+    void download()
+    {
+      while (auto post = fetched.pop())
+      {
+        std::vector<std::string> paths;
+        Budget::Lease disk;
+        if (!post->get_media().empty() && !uploader.relaying())// relayed media is downloaded while uploading
+        {
+          // the sizes are only known once downloaded, until then the average so far is taken
+          disk = Budget::disk().acquire(post->get_media().size() * average_media_size());
+          if (!retry([&] { paths = uploader.cache(*post); }))
+          {
+            uploader.drop_cache(*post);
+            skip(*post);
+            continue;
+          }
+          disk.resize(staged_size(paths));
+        }
+        Metrics::get().add("sotpider_posts_total", {{"stage", "downloaded"}});
+        downloaded.push({std::move(*post), std::move(paths), std::move(disk)});
+      }
+    }
+    
+    void upload()
+    {
+      while (auto staged = downloaded.pop())
+      {
+        staged->post.print();
+        if (batcher != nullptr)
+        {
+          // media and tags are uploaded here, the post itself goes with the next batch
+          Uploader::PostForm form;
+          bool prepared = retry([&] { form = uploader.prepare(staged->post, staged->paths); });
+          uploader.remove_cache(staged->paths);
+          staged->disk.release();
+          if (!prepared)
+          {
+            skip(staged->post);
+            continue;
+          }
+          batcher->add(std::move(form), [this, post = std::move(staged->post)](auto &result)
+          {
+            if (auto error = std::get_if<HttpError>(&result))
+            {
+              std::cerr << error->get_content() << std::endl;
+              skip(post);
+            }
+            else
+              finish(post, std::get<int>(result));
+          });
+          continue;
+        }
+        int id = 0;
+        bool uploaded = retry([&] { id = uploader.upload(staged->post, staged->paths); });
+        uploader.remove_cache(staged->paths);
+        staged->disk.release();
+        if (uploaded)
+          finish(staged->post, id);
+        else
+          skip(staged->post);
+        std::cout << "-------------------------------------------\n";
+      }
+    }
+    
+    // The post is left for the next crawl: the mark of its id does not move past it.
+    void skip(const Post &post)
+    {
+      std::cerr << "Skipped post " << post.get_key() << "." << std::endl;
+      Metrics::get().add("sotpider_posts_total", {{"stage", "skipped"}});
+      if (marks != nullptr)
+      {
+        std::string id(post.get_search_id());
+        std::lock_guard l(pages_mtx);
+        auto &crawl = crawls[id];
+        --crawl.outstanding;
+        crawl.failed = true;
+        advance_mark(id);
+      }
+    }
+    
+    void finish(const Post &post, int wordpress_id)
+    {
+      Metrics::get().add("sotpider_posts_total", {{"stage", "uploaded"}});
+      if (journal != nullptr)
+        journal->finish_post(post.get_key(), wordpress_id);
+      std::lock_guard l(pages_mtx);
+      auto it = unfinished_pages.find({std::string(post.get_search_id()), post.get_page()});
+      if (it != unfinished_pages.end() && --it->second == 0)
+      {
+        journal->finish_page(it->first.first, it->first.second);
+        unfinished_pages.erase(it);
+      }
+      if (marks != nullptr)
+      {
+        std::string id(post.get_search_id());
+        --crawls[id].outstanding;
+        advance_mark(id);
+      }
+    }
+    
+    // Whether posts of the last crawl of id are still on their way.
+    bool crawling(const std::string &id)
+    {
+      if (marks == nullptr) return false;
+      std::lock_guard l(pages_mtx);
+      return crawls.count(id) != 0;
+    }
+    
+    // Called with pages_mtx held. The mark only moves once the whole crawl of the id
+    // is uploaded, so a crash before that crawls the same posts again.
+    void advance_mark(const std::string &id)
+    {
+      auto it = crawls.find(id);
+      if (it == crawls.end() || !it->second.fetched || it->second.outstanding != 0) return;
+      if (!it->second.failed && !it->second.newest.empty())
+        marks->advance(id, it->second.newest);
+      crawls.erase(it);
+    }
+    
+    std::size_t average_media_size() const
+    {
+      auto files = staged_files.load();
+      return files == 0 ? std::size_t(1) << 20 : staged_bytes.load() / files;
+    }
+    
+    // Bytes of the files at paths, counted into the average.
+    std::size_t staged_size(const std::vector<std::string> &paths)
+    {
+      std::size_t ret = 0;
+      for (auto &p: paths)
+      {
+        std::error_code ec;
+        auto size = std::filesystem::file_size(p, ec);
+        if (!ec) ret += size;
+      }
+      staged_bytes += ret;
+      staged_files += paths.size();
+      return ret;
+    }
+    
+    // Returns false if the step failed for good.
+    bool retry(const std::function<void()> &step)
+    {
+      return sp::retry(step, backoff, config.max_attempts);
+    }
+  };
+}
+#endif
\ No newline at end of file
@@ -0,0 +1,185 @@
+//   Copyright 2023 sotpider - caozhanhao
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+#ifndef SOTPIDER_POOL_HPP
+#define SOTPIDER_POOL_HPP
+#include "error.hpp"
+#include "curl/curl.h"
+#include <string>
+#include <vector>
+#include <utility>
+#include <mutex>
+#include <algorithm>
+#include <iostream>
+namespace sp
+{
+  // "https://host:port/path?query" -> "https://host:port"
+  std::string origin_of(const std::string &url)
+  {
+    auto scheme = url.find("://");
+    auto beg = scheme == std::string::npos ? 0 : scheme + 3;
+    return url.substr(0, url.find_first_of("/?#", beg));
+  }
+  
+  // Process-wide pool of easy handles. Every handle is attached to one CURLSH,
+  // so the DNS cache and TLS sessions are shared by all Http instances on all threads.
+  // libcurl does not support sharing a connection cache between concurrent threads,
+  // so live connections are kept by the idle handles instead: curl_easy_reset()
+  // leaves them open, and acquire() prefers a handle that last talked to the same origin.
+  // At most max_idle_per_origin handles are kept per origin; release() frees the rest.
+  class CurlPool
+  {
+  private:
+    CURLSH *share;
+    std::mutex share_locks[CURL_LOCK_DATA_LAST];
+    std::mutex idle_lock;
+    std::vector<std::pair<std::string, CURL *>> idle;// (origin, handle)
+    std::size_t max_idle_per_origin;
+    
+    CurlPool() : max_idle_per_origin(16)
+    {
+      curl_global_init(CURL_GLOBAL_ALL);
+      share = curl_share_init();
+      sp_assert(share != nullptr, "curl_share_init() failed");
+      curl_share_setopt(share, CURLSHOPT_LOCKFUNC, lock_callback);
+      curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, unlock_callback);
+      curl_share_setopt(share, CURLSHOPT_USERDATA, this);
+      curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+      curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    }
+  
+  public:
+    CurlPool(const CurlPool &) = delete;
+    
+    ~CurlPool()
+    {
+      for (auto &r: idle)
+        curl_easy_cleanup(r.second);
+      curl_share_cleanup(share);
+      curl_global_cleanup();
+    }
+    
+    static CurlPool &get()
+    {
+      static CurlPool pool;
+      return pool;
+    }
+    
+    // Usually the most transfers one origin sees at once, so a burst does not leave
+    // more handles and connections behind than the next burst can use.
+    void set_max_idle(std::size_t n)
+    {
+      std::lock_guard l(idle_lock);
+      max_idle_per_origin = std::max<std::size_t>(n, 1);
+    }
+    
+    CURL *acquire(const std::string &origin = "")
+    {
+      {
+        std::lock_guard l(idle_lock);
+        if (!idle.empty())
+        {
+          auto it = idle.end() - 1;
+          for (auto r = idle.rbegin(); r != idle.rend(); ++r)
+          {
+            if (r->first == origin)
+            {
+              it = r.base() - 1;
+              break;
+            }
+          }
+          auto curl = it->second;
+          idle.erase(it);
+          curl_easy_setopt(curl, CURLOPT_SHARE, share);
+          return curl;
+        }
+      }
+      auto curl = curl_easy_init();
+      sp_assert(curl != nullptr, "curl_easy_init() failed");
+      curl_easy_setopt(curl, CURLOPT_SHARE, share);
+      return curl;
+    }
+    
+    void release(CURL *curl)
+    {
+      char *url = nullptr;
+      curl_easy_getinfo(curl, CURLINFO_EFFECTIVE_URL, &url);
+      std::string origin = url == nullptr ? "" : origin_of(url);
+      curl_easy_reset(curl);
+      {
+        std::lock_guard l(idle_lock);
+        auto n = std::count_if(idle.begin(), idle.end(), [&origin](auto &r) { return r.first == origin; });
+        if (static_cast<std::size_t>(n) < max_idle_per_origin)
+        {
+          idle.emplace_back(std::move(origin), curl);
+          return;
+        }
+      }
+      curl_easy_cleanup(curl);
+    }
+    
+    // Resolves, connects and handshakes with every server at once on one multi handle,
+    // so the first real requests find a cached address and a TLS session. The
+    // connections themselves belong to the multi handle and close with it.
+    void preconnect(const std::vector<std::string> &urls, int timeout = -1)
+    {
+      auto multi = curl_multi_init();
+      sp_assert(multi != nullptr, "curl_multi_init() failed");
+      std::vector<CURL *> handles;
+      for (auto &url: urls)
+      {
+        if (url.empty()) continue;
+        auto curl = acquire(origin_of(url));
+        curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+        curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+        curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+        if (timeout != -1) curl_easy_setopt(curl, CURLOPT_TIMEOUT, timeout);
+        curl_multi_add_handle(multi, curl);
+        handles.emplace_back(curl);
+      }
+      int running = 0;
+      do
+      {
+        if (curl_multi_perform(multi, &running) != CURLM_OK) break;
+        if (running != 0 && curl_multi_poll(multi, nullptr, 0, 1000, nullptr) != CURLM_OK) break;
+      } while (running != 0);
+      int left = 0;
+      while (auto msg = curl_multi_info_read(multi, &left))
+      {
+        if (msg->msg != CURLMSG_DONE || msg->data.result == CURLE_OK) continue;
+        char *url = nullptr;
+        curl_easy_getinfo(msg->easy_handle, CURLINFO_EFFECTIVE_URL, &url);
+        std::cerr << "Preconnecting to " << (url == nullptr ? "" : url) << " failed: '"
+                  << curl_easy_strerror(msg->data.result) << "'." << std::endl;
+      }
+      for (auto curl: handles)
+      {
+        curl_multi_remove_handle(multi, curl);
+        release(curl);
+      }
+      curl_multi_cleanup(multi);
+    }
+  
+  private:
+    static void lock_callback(CURL *, curl_lock_data data, curl_lock_access, void *userp)
+    {
+      static_cast<CurlPool *>(userp)->share_locks[data].lock();
+    }
+    
+    static void unlock_callback(CURL *, curl_lock_data data, void *userp)
+    {
+      static_cast<CurlPool *>(userp)->share_locks[data].unlock();
+    }
+  };
+}
+#endif
\ No newline at end of file
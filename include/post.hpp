@@ -15,11 +15,22 @@
 #define SOTPIDER_POST_HPP
 #include "http.hpp"
 #include "error.hpp"
+#include "intern.hpp"
+#include "budget.hpp"
+#include "download.hpp"
+#include "hash.hpp"
 #include "curl/curl.h"
 #include <vector>
 #include <string_view>
 #include <string>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <limits>
+#include <algorithm>
+#include <functional>
+#include <cstring>
+#include <cstdint>
 #include <rapidjson/document.h>
 namespace sp
 {
@@ -28,49 +39,205 @@ namespace sp
   public:
     enum class Type { Empty, Image, Video, Text };
   private:
-    std::vector<std::string> tags;
-    std::string user;
-    std::string userid;
+    // user, userid, tags and url_prefix are interned, so a backlog of posts
+    // only pays for its texts, ids and media urls.
+    std::vector<std::string_view> tags;
+    std::string_view user;// empty -> userid
+    std::string_view userid;
     std::string text;
-    std::vector<std::pair<Type, std::string>> urls;
+    std::string_view url_prefix;// e.g. download_server + "/download?url="
+    std::vector<std::pair<Type, std::string>> media;// escaped, after url_prefix
+    std::string id;// may be empty
+    std::size_t page_number;
   public:
-    Post(std::string user_, std::string userid_, std::string text_, std::vector<std::string> tags_,
-         std::vector<std::pair<Type, std::string>> url_)
-        : tags(std::move(tags_)), user(user_), userid(userid_),
-          text(std::move(text_)), urls(std::move(url_)) {}
+    Post(std::string_view user_, std::string_view userid_, std::string text_,
+         const std::vector<std::string_view> &tags_, std::string_view url_prefix_,
+         std::vector<std::pair<Type, std::string>> media_, std::string id_ = "", std::size_t page_number_ = 0)
+        : user(Interner::get().intern(user_)), userid(Interner::get().intern(userid_)), text(std::move(text_)),
+          url_prefix(Interner::get().intern(url_prefix_)), media(std::move(media_)), id(std::move(id_)),
+          page_number(page_number_)
+    {
+      tags.reserve(tags_.size());
+      for (auto &t: tags_)
+        tags.emplace_back(Interner::get().intern(t));
+    }
+    
+    // The search id the post was found under.
+    std::string_view get_search_id() const { return userid; }
+    
+    const auto &get_id() const { return id; }
+    
+    std::size_t get_page() const { return page_number; }
+    
+    // Identifies the post across runs and builds. Without an id, the XXH64 of its media
+    // urls stands in, which stay put while newer posts push it to another page. A post
+    // without media falls back to its text, so only posts with nothing to upload share a key.
+    std::string get_key() const
+    {
+      if (!id.empty()) return std::string(userid) + "/" + id;
+      Hash64 h;
+      for (auto &m: media)
+      {
+        h.update(m.second.data(), m.second.size());
+        h.update("\n", 1);
+      }
+      if (media.empty())
+        h.update(text.data(), text.size());
+      return std::string(userid) + "#" + h.hex();
+    }
     
     const auto &get_tags() const { return tags; }
     
-    const auto &get_text() const { return text; }
+    std::string_view get_text() const { return text; }
+    
+    // The type and the escaped source url of every media.
+    const auto &get_media() const { return media; }
+    
+    // Where media i is downloaded from.
+    std::string get_url(std::size_t i) const { return std::string(url_prefix) + media[i].second; }
+    
+    std::string_view get_user() const { return user.empty() ? userid : user; }
     
-    const auto &get_url() const { return urls; }
+    std::string_view get_userid() const { return get_user(); }
     
-    const auto &get_user() const { return user; }
+    // Roughly the heap and inline bytes the post takes up.
+    std::size_t footprint() const
+    {
+      auto ret = sizeof(Post) + text.capacity() + id.capacity()
+                 + tags.capacity() * sizeof(std::string_view) + media.capacity() * sizeof(media[0]);
+      for (auto &m: media)
+        ret += m.second.capacity();
+      return ret;
+    }
     
-    const auto &get_userid() const { return user; }
+    // Appends the post to out, to be read back by decode().
+    void encode(std::string &out) const
+    {
+      auto put_num = [&out](std::uint64_t n) { out.append(reinterpret_cast<const char *>(&n), sizeof(n)); };
+      auto put_str = [&out, &put_num](std::string_view str)
+      {
+        put_num(str.size());
+        out.append(str);
+      };
+      put_str(user);
+      put_str(userid);
+      put_str(text);
+      put_str(url_prefix);
+      put_str(id);
+      put_num(page_number);
+      put_num(tags.size());
+      for (auto &t: tags)
+        put_str(t);
+      put_num(media.size());
+      for (auto &[type, url]: media)
+      {
+        put_num(static_cast<std::uint64_t>(type));
+        put_str(url);
+      }
+    }
+    
+    static Post decode(std::string_view in)
+    {
+      auto get_num = [&in]
+      {
+        std::uint64_t n;
+        sp_assert(in.size() >= sizeof(n), "Truncated post.");
+        std::memcpy(&n, in.data(), sizeof(n));
+        in.remove_prefix(sizeof(n));
+        return n;
+      };
+      auto get_str = [&in, &get_num]
+      {
+        auto size = get_num();
+        sp_assert(in.size() >= size, "Truncated post.");
+        auto str = in.substr(0, size);
+        in.remove_prefix(size);
+        return str;
+      };
+      auto user = get_str();
+      auto userid = get_str();
+      auto text = get_str();
+      auto url_prefix = get_str();
+      auto id = get_str();
+      auto page = get_num();
+      std::vector<std::string_view> tags(get_num());
+      for (auto &t: tags)
+        t = get_str();
+      std::vector<std::pair<Type, std::string>> media(get_num());
+      for (auto &[type, url]: media)
+      {
+        type = static_cast<Type>(get_num());
+        url = get_str();
+      }
+      return {user, userid, std::string(text), tags, url_prefix, std::move(media), std::string(id), page};
+    }
     
-    void download(int timeout, const std::vector<std::string> &paths = {}) const
+    // All media of the post are downloaded at the same time, see Download for
+    // how a failed attempt is resumed and how large files are split.
+    // If hashes is given, it receives the Hash64::hex() of every file.
+    void download(const DownloadOptions &options, const std::vector<std::string> &paths = {},
+                  std::vector<std::string> *hashes = nullptr) const
     {
-      for (size_t i = 0; i < urls.size(); ++i)
+      std::vector<std::unique_ptr<Download>> ds;
+      std::vector<Hash64> digests(media.size());
+      for (size_t i = 0; i < media.size(); ++i)
       {
-        std::cout << "Downloading: " << i << "/" << urls.size() << std::endl;
         std::string filename;
         if (i < paths.size())
           filename = paths[i];
         else
-          filename = (paths.empty() ? text : paths.back()) + std::to_string(i - paths.size());
-        Http h{urls[i].second};
-        if(timeout != -1) h.set_timeout(timeout);
-        h.set_file(filename);
-        //h.set_bar();
-        h.get();
+          filename = std::string(paths.empty() ? text : std::string_view(paths.back()))
+                     + std::to_string(i - paths.size());
+        ds.emplace_back(std::make_unique<Download>(get_url(i), filename, options));
+      }
+      if (options.ranges > 1)
+      {
+        Multi probes;
+        for (auto &d: ds)
+          if (auto h = d->probe()) probes.add(*h);
+        while (!probes.empty())
+          probes.wait();
+        for (auto &d: ds)
+          d->probed();
+      }
+      Multi multi;// declared last, so it releases the handles before they are destroyed
+      for (size_t i = 0; i < ds.size(); ++i)
+        for (auto h: ds[i]->start(hashes == nullptr ? nullptr : &digests[i]))
+          multi.add(*h);
+      std::cout << "Downloading: 0/" << media.size() << std::endl;
+      size_t finished = 0;
+      try
+      {
+        while (!multi.empty())
+        {
+          for (auto &[h, cret]: multi.wait())
+          {
+            auto &d = **std::find_if(ds.begin(), ds.end(), [h = h](auto &d) { return d->owns(h); });
+            d.finished(*h, cret);
+            if (d.done())
+              std::cout << "Downloading: " << ++finished << "/" << media.size() << std::endl;
+          }
+        }
+      }
+      catch (...)
+      {
+        for (auto &d: ds)
+          d->suspend();
+        throw;
+      }
+      if (hashes != nullptr)
+        hashes->resize(ds.size());
+      for (size_t i = 0; i < ds.size(); ++i)
+      {
+        if (hashes != nullptr)
+          (*hashes)[i] = digests[i].hex();
+        ds[i]->commit(hashes == nullptr ? nullptr : &(*hashes)[i]);
       }
-      std::cout << "Downloading: " << urls.size() << "/" << urls.size() << std::endl;
     }
     
     void print() const
     {
-      std::cout << "User: " << user << "\n";
+      std::cout << "User: " << get_user() << "\n";
       if (!text.empty())
         std::cout << "Text: \n" << text << "\n";
       if (!tags.empty())
@@ -78,15 +245,18 @@ namespace sp
         std::cout << "Tags: \n";
         std::string tagstr;
         for (auto it = tags.cbegin(); it < tags.cend(); ++it)
-          tagstr += *it + " | ";
+        {
+          tagstr += *it;
+          tagstr += " | ";
+        }
         if (!tagstr.empty())
           tagstr.erase(tagstr.size() - 3);
         std::cout << tagstr << "\n";
       }
-      if (!urls.empty())
+      if (!media.empty())
       {
         std::cout << "Url: \n";
-        for (auto &m: urls)
+        for (auto &m: media)
         {
           switch (m.first)
           {
@@ -106,7 +276,7 @@ namespace sp
               sp_unreachable();
               break;
           }
-          std::cout << "  |  " << m.second << "\n";
+          std::cout << "  |  " << url_prefix << m.second << "\n";
         }
       }
     }
@@ -114,115 +284,280 @@ namespace sp
   
   class PostGetter
   {
+  public:
+    using PageCallback = std::function<void(size_t, std::vector<Post> &&)>;
+    using SkipPredicate = std::function<bool(const std::string &, size_t)>;
+    using StopPredicate = std::function<bool(const std::string &, const std::vector<Post> &)>;
   private:
     std::string server;
     std::string download_server;
     CURL *curl;
     int timeout;
+    std::size_t concurrency;
+    std::size_t page_size;// memory taken for a page before its size is known, the largest so far
+    SkipPredicate skip;
+    StopPredicate stop;
   public:
-    PostGetter(std::string server_, std::string download_server_, int timeout_ = -1)
-    : server(std::move(server_)), download_server(std::move(download_server_)), curl(curl_easy_init()),
-    timeout(timeout_)
+    PostGetter(std::string server_, std::string download_server_, int timeout_ = -1, std::size_t concurrency_ = 1)
+    : server(std::move(server_)), download_server(std::move(download_server_)), curl(CurlPool::get().acquire()),
+    timeout(timeout_), concurrency(concurrency_), page_size(256 * 1024)
     {
-      sp_assert(curl != nullptr, "curl_easy_init() failed.");
     }
     
     ~PostGetter()
     {
-      curl_easy_cleanup(curl);
+      CurlPool::get().release(curl);
+    }
+    
+    // Pages for which skip(id, page) is true are not fetched, e.g. because they are already done.
+    PostGetter &set_skip(SkipPredicate skip_)
+    {
+      skip = std::move(skip_);
+      return *this;
+    }
+    
+    // The page for which stop(id, posts) is true is the last one fetched, e.g. because
+    // it reaches posts that have been seen before.
+    PostGetter &set_stop(StopPredicate stop_)
+    {
+      stop = std::move(stop_);
+      return *this;
     }
     
     std::vector<Post> fetch_video(const std::string &id, const std::pair<int, int> &page_range = {1, -1})
     //[page beg, page end)
+    {
+      std::vector<Post> ret;
+      fetch_video(id, page_range, [&ret](size_t, std::vector<Post> &&posts)
+      {
+        ret.insert(ret.end(), std::make_move_iterator(posts.begin()), std::make_move_iterator(posts.end()));
+      });
+      return ret;
+    }
+    
+    // Hands every page's posts to on_page as soon as the page is parsed, in page order.
+    void fetch_video(const std::string &id, const std::pair<int, int> &page_range, const PageCallback &on_page)
+    //[page beg, page end)
     {
       sp_assert(page_range.first >= 1 && (page_range.second == -1 || page_range.first < page_range.second),
                 "Invalid range");
-      std::vector<Post> ret;
+      if (concurrency > 1)
+      {
+        fetch_video_concurrently(id, page_range, on_page);
+        return;
+      }
       size_t page = page_range.first;
       while (true)
       {
         if (page_range.second != -1 && page >= page_range.second) break;
-        std::cout << "Fetching " + id + "'s page " << page << std::endl;
-        std::string url =
-            std::string(server) + "/v2/user/" + id + "/?after=" + std::to_string(page) + "&page=" + std::to_string(page);
-        Http h{url};
-        if(timeout != -1) h.set_timeout(timeout);
-        h.set_header(
-            {"User-Agent: Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/109.0.0.0 Safari/537.36 Edg/109.0.1518.52"});
-        auto resp = h.set_str().get().response.strp();
-        sp_assert(resp != nullptr, "No Response.");
-        auto &res = *resp;
-        if (h.response_code != 200)
+        if (skip && skip(id, page))
+        {
+          page++;
+          continue;
+        }
+        auto h = make_page_request(id, page);
+        h->get();
+        std::vector<Post> posts;
+        if (!parse_page(id, page, *h, posts)) break;
+        bool last = stop && stop(id, posts);
+        on_page(page, std::move(posts));
+        page++;
+        if (last) break;
+      }
+    }
+  
+  private:
+    // Keeps up to `concurrency` pages in flight. Pages finish in any order,
+    // but they are parsed strictly in page order, so the first 404 ends the
+    // range exactly as the sequential loop does, and the pages after it are cancelled.
+    void fetch_video_concurrently(const std::string &id, const std::pair<int, int> &page_range,
+                                  const PageCallback &on_page)
+    {
+      std::map<size_t, std::unique_ptr<Http>> inflight;
+      std::map<size_t, std::unique_ptr<Http>> finished;
+      Multi multi;// declared last, so it releases the handles before they are destroyed
+      size_t end = page_range.second == -1 ? std::numeric_limits<size_t>::max() : page_range.second;
+      size_t next = page_range.first;
+      size_t page = page_range.first;
+      auto truncate = [&](size_t new_end)
+      {
+        end = new_end;
+        for (auto cancel = inflight.lower_bound(end); cancel != inflight.end();)
+        {
+          multi.remove(*cancel->second);
+          cancel = inflight.erase(cancel);
+        }
+        finished.erase(finished.lower_bound(end), finished.end());
+      };
+      while (page < end)
+      {
+        for (; inflight.size() < concurrency && next < end; ++next)
+        {
+          if (skip && skip(id, next))
+          {
+            finished.emplace(next, nullptr);
+            continue;
+          }
+          // with pages in flight, only start another one if memory allows
+          auto h = make_page_request(id, next, inflight.empty());
+          if (h == nullptr) break;
+          multi.add(h->prepare_get());
+          inflight.emplace(next, std::move(h));
+        }
+        for (auto &[h, cret]: multi.wait())
+        {
+          auto it = std::find_if(inflight.begin(), inflight.end(),
+                                 [h = h](auto &r) { return r.second.get() == h; });
+          sp_assert(it != inflight.end(), "Unknown transfer.");
+          check_curl(cret);
+          auto p = it->first;
+          finished.emplace(p, std::move(it->second));
+          inflight.erase(it);
+          if (h->response_code == 404 && p + 1 < end)
+            truncate(p + 1);
+        }
+        for (auto it = finished.find(page); it != finished.end(); it = finished.find(page))
         {
-          if (page == 1)  // Page 1 must be available
+          if (it->second == nullptr)// skipped
           {
-            sp_unreachable("Unexpected response: Response code: " + std::to_string(h.response_code)
-                           + ", Response: \n" + res);
+            finished.erase(it);
+            ++page;
+            continue;
           }
-          else if (h.response_code != 404)
+          std::vector<Post> posts;
+          bool more = parse_page(id, page, *it->second, posts);
+          finished.erase(it);
+          if (!more)
           {
-            sp_unreachable("Unexpected response: Response code: " + std::to_string(h.response_code)
-                           + ", Response: \n" + res);
+            end = ++page;
+            break;
+          }
+          bool last = stop && stop(id, posts);
+          on_page(page++, std::move(posts));
+          if (last)
+          {
+            truncate(page);
+            break;
           }
-          else
-            break;// 404 -> no more page
         }
-        rapidjson::Document doc;
-        doc.Parse(res.c_str());
-        auto &d = doc["data"];
-        for (auto it = d.Begin(); it != d.End(); ++it)
+      }
+    }
+    
+    // Takes the memory for the page first. nullptr if wait is false and there is none.
+    std::unique_ptr<Http> make_page_request(const std::string &id, size_t page, bool wait = true)
+    {
+      auto lease = wait ? Budget::memory().acquire(page_size) : Budget::memory().try_acquire(page_size);
+      if (!lease) return nullptr;
+      std::cout << "Fetching " + id + "'s page " << page << std::endl;
+      std::string url =
+          std::string(server) + "/v2/user/" + id + "/?after=" + std::to_string(page) + "&page=" + std::to_string(page);
+      auto h = std::make_unique<Http>(url);
+      if(timeout != -1) h->set_timeout(timeout);
+      h->set_header(
+          {"User-Agent: Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/109.0.0.0 Safari/537.36 Edg/109.0.1518.52"});
+      h->set_stage(Stage::Page).set_str().set_compressed().set_budget(std::move(lease));
+      return h;
+    }
+    
+    // Returns false if there is no more page.
+    bool parse_page(const std::string &id, size_t page, Http &h, std::vector<Post> &ret)
+    {
+      auto resp = h.response.strp();
+      sp_assert(resp != nullptr, "No Response.");
+      // Page 1 must be available, a later 404 means there is no more page.
+      if (h.response_code == 404 && page != 1)
+        return false;
+      h.check_status();
+      page_size = std::max(page_size, resp->size());
+      parse_posts(id, resp, ret, page);
+      return true;
+    }
+  
+  public:
+    // Parses a page in place and copies out only what the posts need, so the
+    // page is freed as soon as it is parsed. Missing or mistyped fields are
+    // skipped instead of failing the whole page.
+    void parse_posts(const std::string &id, std::shared_ptr<std::string> body, std::vector<Post> &ret,
+                     size_t page = 0)
+    {
+      rapidjson::Document doc;
+      doc.ParseInsitu(body->data());
+      sp_assert(!doc.HasParseError() && doc.IsObject(), "Invalid page of " + id + ".");
+      auto data = doc.FindMember("data");
+      sp_assert(data != doc.MemberEnd() && data->value.IsArray(), "Invalid page of " + id + ": No data.");
+      auto url_prefix = Interner::get().intern(download_server + "/download?url=");
+      for (auto it = data->value.Begin(); it != data->value.End(); ++it)
+      {
+        if (!it->IsObject()) continue;
+        // user
+        std::string_view user;
+        if (auto u = it->FindMember("user"); u != it->MemberEnd())
+          user = get_str(u->value, "name");
+        // text
+        auto text = get_str(*it, "text");
+        // tags
+        std::vector<std::string_view> tags;
+        if (auto t = it->FindMember("tagEntities"); t != it->MemberEnd() && t->value.IsArray())
+          for (auto tag = t->value.Begin(); tag != t->value.End(); ++tag)
+            if (auto str = get_str(*tag, "text"); !str.empty())
+              tags.emplace_back(str);
+        // download url
+        std::vector<std::pair<Post::Type, std::string>> media_urls;
+        if (auto m = it->FindMember("mediaEntities"); m != it->MemberEnd() && m->value.IsArray())
         {
-          // user
-          std::string user;
-          if (it->FindMember("user") != it->MemberEnd())
-            user = (*it)["user"]["name"].GetString();
-          else
-            user = id;
-          // text
-          std::string text = (*it)["text"].GetString();
-          // tags
-          std::vector<std::string> tags;
-          auto tagsit = it->FindMember("tagEntities");
-          if (tagsit != it->MemberEnd())
-            for (auto it = tagsit->value.Begin(); it != tagsit->value.End(); ++it)
-              tags.emplace_back((*it)["text"].GetString());
-          // download url
-          std::vector<std::pair<Post::Type, std::string>> download_urls;
-          if (auto m = it->FindMember("mediaEntities"); m != it->MemberEnd() && !m->value.Empty())
+          for (size_t i = 0; i < m->value.Size(); ++i)
           {
-            for (size_t i = 0; i < m->value.Size(); ++i)
+            auto &media = m->value[i];
+            if (!media.IsObject()) continue;
+            if (auto v = media.FindMember("videoInfo"); v != media.MemberEnd())
             {
-              if (auto v = m->value[i].FindMember("videoInfo"); v != m->value[i].MemberEnd())
-              {
-                download_urls.emplace_back(
-                    Post::Type::Video,
-                    download_server + "/download?url=" + escape(v->value["variants"][i]["url"].GetString()));
-              }
-              else if (auto p = m->value[i].FindMember("mediaURL"); p != m->value[i].MemberEnd())
+              std::string_view url;
+              if (v->value.IsObject())
               {
-                download_urls.emplace_back(
-                    Post::Type::Image,  download_server + "/download?url=" + escape(p->value.GetString()));
+                if (auto va = v->value.FindMember("variants");
+                    va != v->value.MemberEnd() && va->value.IsArray() && !va->value.Empty())
+                  url = get_str(va->value[i < va->value.Size() ? i : 0], "url");
               }
-              else
-                sp_unreachable();
+              if (!url.empty())
+                media_urls.emplace_back(Post::Type::Video, escape(url));
             }
+            else if (auto url = get_str(media, "mediaURL"); !url.empty())
+              media_urls.emplace_back(Post::Type::Image, escape(url));
           }
-          ret.emplace_back(std::move(user), id, std::move(text), std::move(tags), std::move(download_urls));
         }
-        page++;
+        // post id
+        std::string post_id;
+        if (auto i = it->FindMember("id"); i != it->MemberEnd())
+        {
+          if (i->value.IsString())
+            post_id = i->value.GetString();
+          else if (i->value.IsUint64())
+            post_id = std::to_string(i->value.GetUint64());
+          else if (i->value.IsInt64())
+            post_id = std::to_string(i->value.GetInt64());
+        }
+        ret.emplace_back(user, id, std::string(text), tags, url_prefix, std::move(media_urls), std::move(post_id), page);
       }
-      return ret;
     }
   
-  private:
-    std::string escape(const std::string str)
+    // URL-encodes str, e.g. a media url passed to the download server.
+    std::string escape(std::string_view str)
     {
-      char *output = curl_easy_escape(curl, str.c_str(), str.size());
+      char *output = curl_easy_escape(curl, str.data(), static_cast<int>(str.size()));
       sp_assert(output != nullptr, "curl_easy_escape() failed.");
       std::string ret{output};
       curl_free(output);
       return ret;
     }
+  
+  private:
+    static std::string_view get_str(const rapidjson::Value &v, const char *name)
+    {
+      if (!v.IsObject()) return {};
+      auto it = v.FindMember(name);
+      if (it == v.MemberEnd() || !it->value.IsString()) return {};
+      return {it->value.GetString(), it->value.GetStringLength()};
+    }
   };
 }
 #endif
\ No newline at end of file
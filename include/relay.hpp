@@ -0,0 +1,182 @@
+//   Copyright 2023 sotpider - caozhanhao
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+#ifndef SOTPIDER_RELAY_HPP
+#define SOTPIDER_RELAY_HPP
+#include "error.hpp"
+#include "curl/curl.h"
+#include <vector>
+#include <string>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <fstream>
+#include <filesystem>
+#include <algorithm>
+namespace sp
+{
+  // Moves a body from one transfer (the writer) to another (the reader) through a
+  // bounded in-memory ring. If the reader is slower and the writer has waited on a
+  // full ring for longer than `stall`, everything after that goes to a spill file,
+  // and the reader drains the ring and then the file, so the order is kept.
+  class Relay
+  {
+  private:
+    std::vector<char> ring;
+    std::size_t head;// read position in ring
+    std::size_t filled;
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::chrono::milliseconds stall;
+    curl_off_t length;
+    bool length_known;
+    bool finished;
+    bool failed;
+    bool cancelled;
+    std::string spill_path;
+    std::fstream spill;
+    std::size_t spill_written;
+    std::size_t spill_read;
+    CURL *source;
+  public:
+    Relay(std::size_t capacity, std::string spill_path_,
+          std::chrono::milliseconds stall_ = std::chrono::milliseconds(1000))
+        : ring(std::max<std::size_t>(capacity, 1)), head(0), filled(0), stall(stall_), length(-1),
+          length_known(false), finished(false), failed(false), cancelled(false),
+          spill_path(std::move(spill_path_)), spill_written(0), spill_read(0),
+          source(nullptr) {}
+    
+    Relay(const Relay &) = delete;
+    
+    ~Relay()
+    {
+      if (spill.is_open())
+      {
+        spill.close();
+        std::filesystem::remove(spill_path);
+      }
+    }
+    
+    // The transfer that writes into the relay. Its Content-Length becomes the length of the body.
+    void set_source(CURL *source_) { source = source_; }
+    
+    // Blocks until the writer knows the size of the body. -1 if unknown.
+    curl_off_t wait_length()
+    {
+      std::unique_lock l(mtx);
+      cv.wait(l, [this] { return length_known || finished; });
+      return length_known ? length : -1;
+    }
+    
+    // Returns false if the reader gave up or spilling failed.
+    bool write(const char *data, std::size_t size)
+    {
+      std::unique_lock l(mtx);
+      if (!length_known)
+      {
+        if (source != nullptr)
+          curl_easy_getinfo(source, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length);
+        length_known = true;
+        cv.notify_all();
+      }
+      while (size != 0)
+      {
+        if (cancelled) return false;
+        if (spill.is_open())
+        {
+          spill.seekp(static_cast<std::streamoff>(spill_written));
+          spill.write(data, static_cast<std::streamsize>(size));
+          spill.flush();
+          if (!spill.good()) return false;
+          spill_written += size;
+          cv.notify_all();
+          return true;
+        }
+        if (filled == ring.size())
+        {
+          if (!cv.wait_for(l, stall, [this] { return cancelled || filled < ring.size(); }))
+          {
+            spill.open(spill_path, std::ios_base::out | std::ios_base::in
+                                   | std::ios_base::trunc | std::ios_base::binary);
+            if (!spill.is_open()) return false;
+          }
+          continue;
+        }
+        auto tail = (head + filled) % ring.size();
+        auto n = std::min(size, std::min(ring.size() - filled, ring.size() - tail));
+        std::copy(data, data + n, ring.begin() + static_cast<std::ptrdiff_t>(tail));
+        filled += n;
+        data += n;
+        size -= n;
+        cv.notify_all();
+      }
+      return true;
+    }
+    
+    // Returns 0 at the end of the body, and CURL_READFUNC_ABORT if the writer failed.
+    std::size_t read(char *buffer, std::size_t size)
+    {
+      std::unique_lock l(mtx);
+      cv.wait(l, [this] { return filled != 0 || spill_read < spill_written || finished; });
+      if (filled != 0)
+      {
+        auto n = std::min(size, std::min(filled, ring.size() - head));
+        std::copy(ring.begin() + static_cast<std::ptrdiff_t>(head),
+                  ring.begin() + static_cast<std::ptrdiff_t>(head + n), buffer);
+        head = (head + n) % ring.size();
+        filled -= n;
+        cv.notify_all();
+        return n;
+      }
+      if (spill_read < spill_written)
+      {
+        auto n = std::min(size, spill_written - spill_read);
+        spill.seekg(static_cast<std::streamoff>(spill_read));
+        spill.read(buffer, static_cast<std::streamsize>(n));
+        if (!spill.good()) return CURL_READFUNC_ABORT;
+        spill_read += n;
+        return n;
+      }
+      return failed ? CURL_READFUNC_ABORT : 0;
+    }
+    
+    // Called by the writer when the body is complete, or when the transfer failed.
+    void finish(bool ok)
+    {
+      std::lock_guard l(mtx);
+      finished = true;
+      failed = !ok;
+      cv.notify_all();
+    }
+    
+    // Called by the reader if it gives up, so the writer does not wait forever.
+    void cancel()
+    {
+      std::lock_guard l(mtx);
+      cancelled = true;
+      cv.notify_all();
+    }
+    
+    [[nodiscard]] bool spilled()
+    {
+      std::lock_guard l(mtx);
+      return spill.is_open();
+    }
+  };
+  
+  std::size_t relay_read_callback(char *buffer, size_t size, size_t nitems, void *arg)
+  {
+    return static_cast<Relay *>(arg)->read(buffer, size * nitems);
+  }
+}
+#endif
\ No newline at end of file
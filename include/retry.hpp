@@ -0,0 +1,302 @@
+//   Copyright 2023 sotpider - caozhanhao
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+#ifndef SOTPIDER_RETRY_HPP
+#define SOTPIDER_RETRY_HPP
+#include "error.hpp"
+#include "curl/curl.h"
+#include <string>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <random>
+#include <functional>
+#include <iostream>
+#include <algorithm>
+#include <ctime>
+#include <cctype>
+namespace sp
+{
+  // What a failed request means for trying it again.
+  enum class Failure { Transient, RateLimited, Permanent };
+  
+  Failure classify(CURLcode cret, long status)
+  {
+    if (cret != CURLE_OK)
+    {
+      switch (cret)
+      {
+        case CURLE_UNSUPPORTED_PROTOCOL:
+        case CURLE_URL_MALFORMAT:
+        case CURLE_NOT_BUILT_IN:
+        case CURLE_REMOTE_ACCESS_DENIED:
+        case CURLE_WRITE_ERROR:// the local side, e.g. a full disk or a cancelled relay
+        case CURLE_ABORTED_BY_CALLBACK:
+        case CURLE_FILESIZE_EXCEEDED:
+        case CURLE_LOGIN_DENIED:
+        case CURLE_PEER_FAILED_VERIFICATION:
+        case CURLE_SSL_CERTPROBLEM:
+        case CURLE_SSL_CACERT_BADFILE:
+          return Failure::Permanent;
+        default:// timeouts, resets, DNS and connection failures
+          return Failure::Transient;
+      }
+    }
+    if (status == 429) return Failure::RateLimited;
+    if (status == 408 || status == 425 || (status >= 500 && status != 501 && status != 505))
+      return Failure::Transient;
+    return Failure::Permanent;
+  }
+  
+  class HttpError : public Error
+  {
+  private:
+    Failure failure;
+    std::chrono::milliseconds retry_after;
+  public:
+    HttpError(const std::string &detail_, Failure failure_,
+              std::chrono::milliseconds retry_after_ = std::chrono::milliseconds(-1),
+              const std::experimental::source_location &l = std::experimental::source_location::current())
+        : Error(detail_, l), failure(failure_), retry_after(retry_after_) {}
+    
+    [[nodiscard]] Failure get_failure() const { return failure; }
+    
+    [[nodiscard]] bool retryable() const { return failure != Failure::Permanent; }
+    
+    // What the server asked for with Retry-After, -1 if nothing.
+    [[nodiscard]] std::chrono::milliseconds get_retry_after() const { return retry_after; }
+  };
+  
+  void check_curl(CURLcode cret, const std::experimental::source_location &l =
+  std::experimental::source_location::current())
+  {
+    if (cret != CURLE_OK)
+      throw HttpError("curl_easy_perform() failed: '" + std::string(curl_easy_strerror(cret)) + "'.",
+                      classify(cret, 0), std::chrono::milliseconds(-1), l);
+  }
+  
+  // Retry-After is either a number of seconds or an HTTP date.
+  std::chrono::milliseconds parse_retry_after(const std::string &value)
+  {
+    if (value.empty()) return std::chrono::milliseconds(-1);
+    if (std::all_of(value.begin(), value.end(), [](unsigned char c) { return std::isdigit(c); }))
+      return std::chrono::seconds(std::stoll(value.substr(0, 9)));
+    auto date = curl_getdate(value.c_str(), nullptr);
+    if (date == -1) return std::chrono::milliseconds(-1);
+    return std::chrono::seconds(std::max<long long>(date - std::time(nullptr), 0));
+  }
+  
+  // Refills at `rate` tokens per second, up to `burst`. A rate of 0 means no limit.
+  class TokenBucket
+  {
+  private:
+    double rate;
+    double burst;
+    double tokens;
+    std::chrono::steady_clock::time_point last;
+    std::mutex mtx;
+  public:
+    TokenBucket(double rate_, double burst_)
+        : rate(rate_), burst(std::max(burst_, 1.0)), tokens(burst), last(std::chrono::steady_clock::now()) {}
+    
+    // Blocks until n tokens (at most a full bucket) are there, then takes them.
+    void take(double n = 1)
+    {
+      if (rate <= 0) return;
+      std::unique_lock l(mtx);
+      while (true)
+      {
+        refill();
+        if (tokens >= std::min(n, burst))
+        {
+          tokens -= n;
+          return;
+        }
+        auto wait = std::chrono::duration<double>((std::min(n, burst) - tokens) / rate);
+        l.unlock();
+        std::this_thread::sleep_for(wait);
+        l.lock();
+      }
+    }
+    
+    // Takes n tokens now, without blocking, and returns how long the caller has
+    // to wait before using them: the time take() would have slept.
+    std::chrono::duration<double> reserve(double n = 1)
+    {
+      if (rate <= 0) return std::chrono::duration<double>(0);
+      std::lock_guard l(mtx);
+      refill();
+      auto need = std::min(n, burst);
+      auto wait = std::chrono::duration<double>(tokens >= need ? 0 : (need - tokens) / rate);
+      tokens -= n;
+      return wait;
+    }
+    
+    // Takes n tokens after the fact, e.g. the bytes of a finished transfer.
+    // The balance may go negative, and the next take() waits until it is paid off.
+    void debit(double n)
+    {
+      if (rate <= 0) return;
+      std::lock_guard l(mtx);
+      refill();
+      tokens -= n;
+    }
+  
+  private:
+    void refill()
+    {
+      auto now = std::chrono::steady_clock::now();
+      tokens = std::min(burst, tokens + std::chrono::duration<double>(now - last).count() * rate);
+      last = now;
+    }
+  };
+  
+  // Request and bandwidth caps per origin, shared by every Http on every thread.
+  // An origin without limits of its own gets the defaults.
+  class RateLimiter
+  {
+  private:
+    struct Limits
+    {
+      TokenBucket requests;
+      TokenBucket bytes;
+      
+      Limits(double requests_per_second, double bytes_per_second)
+          : requests(requests_per_second, requests_per_second), bytes(bytes_per_second, bytes_per_second) {}
+    };
+    
+    std::mutex mtx;
+    std::map<std::string, std::unique_ptr<Limits>> limits;
+    double default_requests;
+    double default_bytes;
+    
+    RateLimiter() : default_requests(0), default_bytes(0) {}
+  
+  public:
+    RateLimiter(const RateLimiter &) = delete;
+    
+    static RateLimiter &get()
+    {
+      static RateLimiter limiter;
+      return limiter;
+    }
+    
+    // 0 means no limit. Applies to origins that have not been used yet.
+    void set_default(double requests_per_second, double bytes_per_second)
+    {
+      std::lock_guard l(mtx);
+      default_requests = requests_per_second;
+      default_bytes = bytes_per_second;
+    }
+    
+    // Has no effect once a request to origin has been made.
+    void set(const std::string &origin, double requests_per_second, double bytes_per_second)
+    {
+      std::lock_guard l(mtx);
+      limits.try_emplace(origin, std::make_unique<Limits>(requests_per_second, bytes_per_second));
+    }
+    
+    // Blocks until a request to origin is allowed.
+    void before(const std::string &origin)
+    {
+      auto &r = of(origin);
+      r.requests.take();
+      r.bytes.take(0);
+    }
+    
+    // Like before(), but returns how long to wait instead of waiting, e.g. for an event loop.
+    std::chrono::duration<double> reserve(const std::string &origin)
+    {
+      auto &r = of(origin);
+      return std::max(r.requests.reserve(), r.bytes.reserve(0));
+    }
+    
+    void after(const std::string &origin, double bytes)
+    {
+      of(origin).bytes.debit(bytes);
+    }
+  
+  private:
+    Limits &of(const std::string &origin)
+    {
+      std::lock_guard l(mtx);
+      auto &r = limits[origin];
+      if (r == nullptr)
+        r = std::make_unique<Limits>(default_requests, default_bytes);
+      return *r;
+    }
+  };
+  
+  // Exponential backoff with full jitter, see retry().
+  struct Backoff
+  {
+    std::chrono::milliseconds base{500};
+    std::chrono::milliseconds cap{60000};
+    
+    // A random delay up to min(cap, base * 2^attempt), but not shorter than retry_after.
+    [[nodiscard]] std::chrono::milliseconds delay(std::size_t attempt,
+                                                  std::chrono::milliseconds retry_after
+                                                  = std::chrono::milliseconds(-1)) const
+    {
+      thread_local std::mt19937_64 rng{std::random_device{}()};
+      auto ceiling = cap.count();
+      if (attempt < 32)
+        ceiling = std::min<long long>(ceiling, base.count() << attempt);
+      std::uniform_int_distribution<long long> dist(0, std::max<long long>(ceiling, 0));
+      return std::max(std::chrono::milliseconds(dist(rng)), retry_after);
+    }
+  };
+  
+  // Runs step until it succeeds, waiting between attempts as backoff says.
+  // Returns false if it failed with a permanent HttpError, or max_attempts times (0: no limit).
+  // Only an HttpError is retried. Anything else, e.g. a malformed page or a failed
+  // assertion, would fail the same way again, so it counts as permanent.
+  bool retry(const std::function<void()> &step, const Backoff &backoff = {}, std::size_t max_attempts = 0)
+  {
+    for (std::size_t attempt = 0;; ++attempt)
+    {
+      auto retry_after = std::chrono::milliseconds(-1);
+      try
+      {
+        step();
+        return true;
+      }
+      catch (HttpError &e)
+      {
+        std::cerr << e.get_content() << std::endl;
+        if (!e.retryable()) return false;
+        retry_after = e.get_retry_after();
+      }
+      catch (sp::Error &e)
+      {
+        std::cerr << e.get_content() << std::endl;
+        return false;
+      }
+      catch (std::exception &e)
+      {
+        std::cerr << e.what() << std::endl;
+        return false;
+      }
+      catch (...)
+      {
+        std::cerr << "Unexpected Error." << std::endl;
+        return false;
+      }
+      if (max_attempts != 0 && attempt + 1 >= max_attempts) return false;
+      std::this_thread::sleep_for(backoff.delay(attempt, retry_after));
+    }
+  }
+}
+#endif
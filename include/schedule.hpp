@@ -0,0 +1,131 @@
+//   Copyright 2023 sotpider - caozhanhao
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+#ifndef SOTPIDER_SCHEDULE_HPP
+#define SOTPIDER_SCHEDULE_HPP
+#include <string>
+#include <vector>
+#include <queue>
+#include <optional>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <random>
+namespace sp
+{
+  // When every search id is crawled next. Every id gets a slot spread evenly over the
+  // interval, and its crawls are due at the slot plus a whole number of intervals,
+  // shifted by up to `jitter` either way. The shifts do not add up, so the ids stay
+  // spread out instead of drifting into one burst.
+  class Schedule
+  {
+  public:
+    using Clock = std::chrono::steady_clock;
+    struct Crawl
+    {
+      std::string id;
+      std::size_t round;// 0 for the first crawl of id
+      Clock::time_point slot;// when round 0 was due
+      Clock::time_point due;
+      
+      bool operator>(const Crawl &c) const { return due > c.due; }
+    };
+  private:
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::priority_queue<Crawl, std::vector<Crawl>, std::greater<>> queue;
+    Clock::duration interval;
+    Clock::duration jitter;
+    std::mt19937_64 rng;
+    bool closed;
+  public:
+    Schedule() : interval(0), jitter(0), rng(std::random_device{}()), closed(false) {}
+    
+    Schedule(const Schedule &) = delete;
+    
+    void start(const std::vector<std::string> &ids, Clock::duration interval_, Clock::duration jitter_)
+    {
+      std::lock_guard l(mtx);
+      interval = interval_;
+      jitter = jitter_;
+      auto now = Clock::now();
+      for (std::size_t i = 0; i < ids.size(); ++i)
+      {
+        auto slot = now + interval * static_cast<long>(i) / static_cast<long>(ids.size());
+        queue.push({ids[i], 0, slot, slot});
+      }
+      cv.notify_all();
+    }
+    
+    // Blocks until a crawl is due. std::nullopt once closed.
+    std::optional<Crawl> next()
+    {
+      std::unique_lock l(mtx);
+      while (!closed)
+      {
+        if (queue.empty())
+        {
+          cv.wait(l);
+          continue;
+        }
+        auto due = queue.top().due;
+        if (due <= Clock::now())
+        {
+          auto crawl = queue.top();
+          queue.pop();
+          return crawl;
+        }
+        cv.wait_until(l, due);
+      }
+      return std::nullopt;
+    }
+    
+    // Schedules the next crawl of c.id. A crawl that took longer than the interval skips the slots it missed.
+    void done(const Crawl &c)
+    {
+      std::lock_guard l(mtx);
+      auto now = Clock::now();
+      auto round = c.round + 1;
+      if (interval.count() > 0 && c.slot + interval * static_cast<long>(round) < now)
+        round = static_cast<std::size_t>((now - c.slot) / interval) + 1;
+      auto due = c.slot + interval * static_cast<long>(round) + shift();
+      queue.push({c.id, round, c.slot, std::max(due, now)});
+      cv.notify_all();
+    }
+    
+    // Tries c again after delay, e.g. while its last crawl is still being uploaded.
+    void postpone(const Crawl &c, Clock::duration delay)
+    {
+      std::lock_guard l(mtx);
+      queue.push({c.id, c.round, c.slot, Clock::now() + delay});
+      cv.notify_all();
+    }
+    
+    void close()
+    {
+      std::lock_guard l(mtx);
+      closed = true;
+      cv.notify_all();
+    }
+  
+  private:
+    // Called with mtx held.
+    Clock::duration shift()
+    {
+      if (jitter.count() <= 0) return Clock::duration::zero();
+      std::uniform_int_distribution<Clock::rep> dist(-jitter.count(), jitter.count());
+      return Clock::duration(dist(rng));
+    }
+  };
+}
+#endif
@@ -15,7 +15,25 @@
 #define SOTPIDER_SOTPIDER_HPP
 #include "base64.hpp"
 #include "error.hpp"
+#include "pool.hpp"
+#include "buffer.hpp"
+#include "writer.hpp"
+#include "hash.hpp"
+#include "retry.hpp"
+#include "metrics.hpp"
+#include "budget.hpp"
+#include "relay.hpp"
 #include "http.hpp"
+#include "async.hpp"
+#include "download.hpp"
+#include "intern.hpp"
 #include "post.hpp"
+#include "spill.hpp"
+#include "media.hpp"
 #include "uploader.h"
+#include "journal.hpp"
+#include "batch.hpp"
+#include "watermark.hpp"
+#include "schedule.hpp"
+#include "pipeline.hpp"
 #endif
@@ -0,0 +1,188 @@
+//   Copyright 2023 sotpider - caozhanhao
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+#ifndef SOTPIDER_SPILL_HPP
+#define SOTPIDER_SPILL_HPP
+#include "error.hpp"
+#include "post.hpp"
+#include "metrics.hpp"
+#include <string>
+#include <deque>
+#include <optional>
+#include <mutex>
+#include <condition_variable>
+#include <cstring>
+#include <cstdint>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+namespace sp
+{
+  // A FIFO of posts that keeps at most `budget` bytes of them in memory and appends
+  // the rest to a memory-mapped file, so a push never waits for the consumers.
+  // Without a path it blocks at `capacity` posts instead, like BoundedQueue.
+  // The file is unlinked as soon as it is created, it only lives as long as the queue.
+  class SpillQueue
+  {
+  private:
+    static constexpr std::size_t initial_size = 1 << 20;
+    
+    std::mutex mtx;
+    std::condition_variable not_empty;
+    std::condition_variable not_full;
+    std::deque<Post> items;// older than every spilled post
+    std::size_t memory;// footprint of items
+    std::size_t capacity;
+    std::size_t budget;
+    bool closed;
+    
+    int fd;
+    char *map;
+    std::size_t mapped;
+    std::size_t head;// next record to read
+    std::size_t tail;// end of the last record
+    std::size_t spilled;// records between head and tail
+    std::string record;
+  public:
+    SpillQueue(std::size_t capacity_, const std::string &path, std::size_t budget_)
+        : memory(0), capacity(capacity_ == 0 ? 1 : capacity_), budget(budget_), closed(false),
+          fd(-1), map(nullptr), mapped(0), head(0), tail(0), spilled(0)
+    {
+      if (path.empty()) return;
+      fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+      sp_assert(fd != -1, "Open '" + path + "' failed.");
+      ::unlink(path.c_str());
+      remap(initial_size);
+    }
+    
+    SpillQueue(const SpillQueue &) = delete;
+    
+    ~SpillQueue()
+    {
+      if (map != nullptr) ::munmap(map, mapped);
+      if (fd != -1) ::close(fd);
+    }
+    
+    // Returns false if the queue has been closed.
+    bool push(Post post)
+    {
+      std::unique_lock l(mtx);
+      if (fd == -1)
+        not_full.wait(l, [this] { return closed || items.size() < capacity; });
+      if (closed) return false;
+      auto size = post.footprint();
+      if (fd != -1 && (spilled != 0 || (!items.empty() && memory + size > budget)))
+        spill(post);
+      else
+      {
+        memory += size;
+        items.emplace_back(std::move(post));
+      }
+      not_empty.notify_one();
+      return true;
+    }
+    
+    // Returns std::nullopt once the queue is closed and drained.
+    std::optional<Post> pop()
+    {
+      std::unique_lock l(mtx);
+      not_empty.wait(l, [this] { return closed || !items.empty() || spilled != 0; });
+      if (!items.empty())
+      {
+        auto post = std::move(items.front());
+        items.pop_front();
+        memory -= post.footprint();
+        not_full.notify_one();
+        return post;
+      }
+      if (spilled != 0) return unspill();
+      return std::nullopt;
+    }
+    
+    void close()
+    {
+      std::lock_guard l(mtx);
+      closed = true;
+      not_empty.notify_all();
+      not_full.notify_all();
+    }
+    
+    // Posts waiting on disk.
+    std::size_t spilled_count()
+    {
+      std::lock_guard l(mtx);
+      return spilled;
+    }
+  
+  private:
+    // Called with mtx held.
+    void spill(const Post &post)
+    {
+      record.clear();
+      post.encode(record);
+      std::uint64_t size = record.size();
+      auto needed = tail + sizeof(size) + record.size();
+      if (needed > mapped)
+        remap(std::max(mapped * 2, needed));
+      std::memcpy(map + tail, &size, sizeof(size));
+      std::memcpy(map + tail + sizeof(size), record.data(), record.size());
+      release(tail, needed);
+      tail = needed;
+      ++spilled;
+      Metrics::get().add("sotpider_posts_spilled_total", {});
+    }
+    
+    // Called with mtx held.
+    Post unspill()
+    {
+      std::uint64_t size;
+      std::memcpy(&size, map + head, sizeof(size));
+      auto post = Post::decode({map + head + sizeof(size), size});
+      auto next = head + sizeof(size) + size;
+      release(head, next);
+      head = next;
+      if (--spilled == 0)
+      {
+        // start over, giving the disk space back
+        head = tail = 0;
+        if (mapped > initial_size)
+          remap(initial_size);
+      }
+      return post;
+    }
+    
+    // [beg, end) has just been written or read: drops the pages before end from the resident set.
+    // Written pages stay dirty in the page cache and are read back from there or from disk.
+    void release(std::size_t beg, std::size_t end)
+    {
+      static const auto page = static_cast<std::size_t>(::sysconf(_SC_PAGESIZE));
+      beg = beg / page * page;
+      end = end / page * page;
+      if (beg < end)
+        ::madvise(map + beg, end - beg, MADV_DONTNEED);
+    }
+    
+    void remap(std::size_t size)
+    {
+      if (map != nullptr) ::munmap(map, mapped);
+      map = nullptr;
+      mapped = 0;
+      sp_assert(::ftruncate(fd, static_cast<off_t>(size)) == 0, "Resizing the spill file failed.");
+      auto p = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      sp_assert(p != MAP_FAILED, "Mapping the spill file failed.");
+      map = static_cast<char *>(p);
+      mapped = size;
+    }
+  };
+}
+#endif
@@ -15,13 +15,28 @@
 #define SOTPIDER_UPLOADER_HPP
 #include "post.hpp"
 #include "base64.hpp"
+#include "relay.hpp"
+#include "budget.hpp"
+#include "media.hpp"
+#include "hash.hpp"
+#include "async.hpp"
 #include <rapidjson/document.h>
+#include <rapidjson/stringbuffer.h>
+#include <rapidjson/writer.h>
 #include <string>
 #include <chrono>
 #include <vector>
 #include <algorithm>
 #include <map>
 #include <filesystem>
+#include <mutex>
+#include <shared_mutex>
+#include <fstream>
+#include <atomic>
+#include <future>
+#include <variant>
+#include <exception>
+#include <memory>
 namespace sp
 {
   std::string get_timestamp()
@@ -39,78 +54,471 @@ namespace sp
     std::string user;
     std::string passwd;
     std::map<std::string, int> tags_cache;
+    std::shared_mutex tags_lock;
+    std::string tags_path;
+    std::atomic<size_t> cache_count;
+    std::size_t relay_buffer;
+    std::unique_ptr<MediaIndex> media_index;
+    std::map<std::string, std::string> cached_hashes;// path from cache() -> Hash64::hex() of the file
+    std::mutex hashes_lock;
+    std::map<std::string, std::string> partial;// Post::get_key() -> directory of a failed cache()
+    std::mutex partial_lock;
     int timeout;
+    DownloadOptions download_options;
   public:
     Uploader(std::string server_, const std::string &username, const std::string &password, int timeout_ = -1)
-        :server(std::move(server_)), user(std::move(username)), passwd(std::move(password)), timeout(timeout_)
+        :server(std::move(server_)), user(std::move(username)), passwd(std::move(password)),
+        cache_count(0), relay_buffer(0), timeout(timeout_)
     {
+      download_options.timeout = timeout;
+    }
+    
+    Uploader(const Uploader &) = delete;
+    
+    ~Uploader()
+    {
+      if (!tags_path.empty())
+      {
+        try
+        {
+          save_tags();
+        }
+        catch (sp::Error &e)
+        {
+          std::cerr << e.get_content() << std::endl;
+        }
+        catch (std::exception &e)// e.g. std::bad_alloc, nothing may leave a destructor
+        {
+          std::cerr << e.what() << std::endl;
+        }
+      }
+    }
+    
+    // Loads the tag cache from path, and writes it back there on exit.
+    // Each line is "<tag id>\t<tag name>".
+    Uploader &set_tags_cache(const std::string &path)
+    {
+      tags_path = path;
+      std::ifstream in(path);
+      std::string line;
+      std::unique_lock l(tags_lock);
+      while (std::getline(in, line))
+      {
+        auto tab = line.find('\t');
+        if (tab == std::string::npos || tab == 0) continue;
+        try
+        {
+          tags_cache[line.substr(tab + 1)] = std::stoi(line.substr(0, tab));
+        }
+        catch (std::logic_error &)
+        {
+          continue;
+        }
+      }
+      return *this;
+    }
+    
+    void save_tags()
+    {
+      auto tmp = tags_path + ".tmp";
+      {
+        std::ofstream out(tmp, std::ios_base::out | std::ios_base::trunc);
+        sp_assert(out.is_open(), "Open file failed.");
+        std::shared_lock l(tags_lock);
+        for (auto &[name, id]: tags_cache)
+          if (name.find('\n') == std::string::npos)
+            out << id << '\t' << name << '\n';
+        sp_assert(out.good(), "Writing '" + tmp + "' failed.");
+      }
+      std::error_code ec;
+      std::filesystem::rename(tmp, tags_path, ec);
+      sp_assert(!ec, "Renaming '" + tmp + "' failed: " + ec.message());
+    }
+    
+    // Fills the tag cache with every tag on the server, using the X-WP-TotalPages
+    // of the first page to fetch the rest, up to concurrency pages at a time on a Loop.
+    void warm_tags(std::size_t concurrency)
+    {
+      auto first = make_tags_request(1);
+      first->get();
+      add_tags(*first);
+      auto total_it = first->response.headers.find("x-wp-totalpages");
+      size_t total = total_it == first->response.headers.end() ? 1 : std::stoul(total_it->second);
+      Loop loop;
+      size_t next = 2;
+      std::exception_ptr error;
+      for (size_t i = 0; i < std::max<size_t>(concurrency, 1) && next + i <= total; ++i)
+        loop.spawn(fetch_tags(loop, next, total, error));
+      loop.drain();
+      if (error) std::rethrow_exception(error);
+      std::cout << "Tag cache: " << tags_cache_size() << " tags" << std::endl;
+    }
+    
+    std::size_t tags_cache_size()
+    {
+      std::shared_lock l(tags_lock);
+      return tags_cache.size();
+    }
+    
+    // Streams media from the download server straight into the media endpoint
+    // through a buffer of buffer_size bytes, instead of caching it on disk. 0 disables it.
+    Uploader &set_relay(std::size_t buffer_size)
+    {
+      relay_buffer = buffer_size;
+      return *this;
+    }
+    
+    [[nodiscard]] bool relaying() const { return relay_buffer != 0; }
+    
+    // Splits media of at least threshold bytes into `ranges` parallel downloads, see Download.
+    Uploader &set_ranges(std::size_t ranges, curl_off_t threshold)
+    {
+      download_options.ranges = std::max<std::size_t>(ranges, 1);
+      download_options.range_threshold = threshold;
+      return *this;
+    }
+    
+    // Media whose bytes have been uploaded before, according to the index at path,
+    // is not uploaded again. Relayed media is only added to the index, as its
+    // hash is known only after it has been sent.
+    Uploader &set_media_index(const std::string &path)
+    {
+      media_index = std::make_unique<MediaIndex>(path);
+      return *this;
     }
     
     int get_tag_id(const std::string &tag)
     {
-      auto it = tags_cache.find(tag);
-      if (it != tags_cache.end()) return it->second;
-      int tag_id = 0;
-      std::string url = server + "/?rest_route=/wp/v2/tags";
-      Http h{url};
-      if(timeout != -1) h.set_timeout(timeout);
-      h.set_header({"Authorization: Basic " + base64_encode(user + ":" + passwd)});
-      h.set_str().post(
+      return get_tag_ids({tag})[0];
+    }
+    
+    // Tags missing from the cache are created at the same time.
+    std::vector<int> get_tag_ids(const std::vector<std::string> &tags)
+    {
+      std::vector<int> ret(tags.size(), 0);
+      std::vector<std::pair<size_t, std::unique_ptr<Http>>> hs;
+      Multi multi;// declared last, so it releases the handles before they are destroyed
+      {
+        std::shared_lock l(tags_lock);
+        for (size_t i = 0; i < tags.size(); ++i)
+        {
+          auto it = tags_cache.find(tags[i]);
+          if (it != tags_cache.end())
           {
-              {Http::FormType::String, "name", tag},
+            ret[i] = it->second;
+            continue;
           }
-      );
-      auto &res = *h.response.strp();
-      rapidjson::Document tag_make;
-      tag_make.Parse(res.c_str());
-      if (tag_make.FindMember("code") != tag_make.MemberEnd())
-        tag_id = tag_make["data"]["term_id"].GetInt();//already exist, but not in cache
-      else
-        tag_id = tag_make["id"].GetInt();
-      tags_cache[tag] = tag_id;
-      return tag_id;
-    }
-    void upload(const Post &t)
-    {
-      // download
-      std::string resources;
-      int feature = 0;
-      if(!t.get_url().empty())
-      {
-        auto medias = get_media_content(t);
-        for(auto& r : medias)
-          resources += r.second + "\n";
-        feature = medias[0].first;
+          auto h = std::make_unique<Http>(server + "/?rest_route=/wp/v2/tags");
+          if(timeout != -1) h->set_timeout(timeout);
+          h->set_header({"Authorization: Basic " + base64_encode(user + ":" + passwd)});
+          h->set_stage(Stage::Tag).set_str().prepare_post(
+              {
+                  {Http::FormType::String, "name", tags[i]},
+              }
+          );
+          hs.emplace_back(i, std::move(h));
+        }
       }
-      std::cout << "Uploading " << std::endl;
-      // upload
-      std::string url = server + "/?rest_route=/wp/v2/posts";
-      std::string tagstr;
-      auto plain_tags = t.get_tags();
+      for (auto &h: hs)
+        multi.add(*h.second);
+      multi.perform_all();
+      for (auto &[i, h]: hs)
+      {
+        h->check_status({400});// 400: the tag exists already
+        auto res = h->response.str();
+        rapidjson::Document tag_make;
+        tag_make.Parse(res.data(), res.size());
+        if (tag_make.FindMember("code") != tag_make.MemberEnd())
+          ret[i] = tag_make["data"]["term_id"].GetInt();//already exist, but not in cache
+        else
+          ret[i] = tag_make["id"].GetInt();
+        std::unique_lock l(tags_lock);
+        tags_cache[tags[i]] = ret[i];
+      }
+      return ret;
+    }
+    
+    // Returns the id of the new WordPress post.
+    int upload(const Post &t)
+    {
+      if (t.get_media().empty() || relaying())
+        return upload(t, {});
+      auto paths = cache(t);
+      auto id = upload(t, paths);
+      remove_cache(paths);
+      return id;
+    }
+    
+    // Uploads a Post whose media has already been downloaded to paths by cache(),
+    // or, when relaying, with empty paths. The files are kept, so a failed upload can be retried.
+    int upload(const Post &t, const std::vector<std::string> &paths)
+    {
+      return publish(prepare(t, paths));
+    }
+    
+    // Everything a WordPress post needs, with its media uploaded and its tags resolved.
+    struct PostForm
+    {
+      std::string title;
+      std::string content;
+      std::vector<int> tags;
+      int featured_media = 0;// 0: none
+    };
+    
+    PostForm prepare(const Post &t, const std::vector<std::string> &paths)
+    {
+      // tags are resolved while the media is being uploaded
+      std::vector<std::string> plain_tags(t.get_tags().cbegin(), t.get_tags().cend());
       plain_tags.emplace_back(t.get_userid());
-      for (size_t i = 0; i < plain_tags.size(); ++i)
-        tagstr += std::to_string(get_tag_id(plain_tags[i])) + ",";
+      auto tag_ids = std::async(std::launch::async, [this, &plain_tags] { return get_tag_ids(plain_tags); });
+      std::vector<std::pair<int, std::string>> medias;
+      if(!paths.empty() || (relaying() && !t.get_media().empty()))
+        medias = paths.empty() ? relay_media(t) : upload_media(paths);
+      auto form = compose(t, medias);
+      form.tags = tag_ids.get();
+      return form;
+    }
+    
+    // Title, content and featured media of t, with its uploaded medias appended to the text.
+    static PostForm compose(const Post &t, const std::vector<std::pair<int, std::string>> &medias)
+    {
+      PostForm form;
+      form.title = std::string(t.get_user()) + "-" + get_timestamp();
+      form.content = std::string(t.get_text()) + "\n";
+      for(auto& r : medias)
+        form.content += r.second + "\n";
+      if (!medias.empty())
+        form.featured_media = medias[0].first;
+      return form;
+    }
+    
+    // The request to /wp/v2/posts creating post.
+    static Http::Form make_form(const PostForm &post)
+    {
+      std::string tagstr;
+      for (auto id: post.tags)
+        tagstr += std::to_string(id) + ",";
       if (!tagstr.empty())
         tagstr.pop_back();
-      Http h{url};
-      if(timeout != -1) h.set_timeout(timeout);
-      h.set_header({"Authorization: Basic " + base64_encode(user + ":" + passwd)});
-      std::string title = t.get_user() + "-" + get_timestamp();
       Http::Form form {
-          {Http::FormType::String, "title",   title},
-          {Http::FormType::String, "content", t.get_text() + "\n" + resources},
+          {Http::FormType::String, "title",   post.title},
+          {Http::FormType::String, "content", post.content},
           {Http::FormType::String, "status",  "publish"},
           {Http::FormType::String, "tags",    tagstr}
       };
-      if(!resources.empty())
-        form.emplace_back(Http::FormType::String, "featured_media", std::to_string(feature));
-      h.set_str().post(form);
-      auto &res = *h.response.strp();
-      sp_assert(res.substr(0, 8) != "{\"code\":", "Unexpected response: Response code: " + std::to_string(h.response_code)
-                                               + ", Response: \n" + res);
+      if(post.featured_media != 0)
+        form.emplace_back(Http::FormType::String, "featured_media", std::to_string(post.featured_media));
+      return form;
+    }
+    
+    int publish(const PostForm &post)
+    {
+      std::cout << "Uploading " << std::endl;
+      // upload
+      std::string url = server + "/?rest_route=/wp/v2/posts";
+      Http h{url};
+      if(timeout != -1) h.set_timeout(timeout);
+      h.set_header({"Authorization: Basic " + base64_encode(user + ":" + passwd)});
+      h.set_stage(Stage::Post).set_str().post(make_form(post));
+      h.check_status();
+      auto res = h.response.str();
+      rapidjson::Document json;
+      json.Parse(res.data(), res.size());
+      sp_assert(!json.HasParseError() && json.IsObject() && json.HasMember("id") && json["id"].IsInt(),
+                "Unexpected response: Response: \n" + std::string(res));
+      return json["id"].GetInt();
+    }
+    
+    // The body of a /batch/v1 request creating posts.
+    static std::string make_batch(const std::vector<const PostForm *> &posts)
+    {
+      rapidjson::StringBuffer buffer;
+      rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+      writer.StartObject();
+      writer.Key("validation");
+      writer.String("normal");
+      writer.Key("requests");
+      writer.StartArray();
+      for (auto post: posts)
+      {
+        writer.StartObject();
+        writer.Key("method");
+        writer.String("POST");
+        writer.Key("path");
+        writer.String("/wp/v2/posts");
+        writer.Key("body");
+        writer.StartObject();
+        writer.Key("title");
+        writer.String(post->title.c_str(), static_cast<rapidjson::SizeType>(post->title.size()));
+        writer.Key("content");
+        writer.String(post->content.c_str(), static_cast<rapidjson::SizeType>(post->content.size()));
+        writer.Key("status");
+        writer.String("publish");
+        writer.Key("tags");
+        writer.StartArray();
+        for (auto id: post->tags)
+          writer.Int(id);
+        writer.EndArray();
+        if (post->featured_media != 0)
+        {
+          writer.Key("featured_media");
+          writer.Int(post->featured_media);
+        }
+        writer.EndObject();
+        writer.EndObject();
+      }
+      writer.EndArray();
+      writer.EndObject();
+      return {buffer.GetString(), buffer.GetSize()};
+    }
+    
+    // Creates up to 25 posts with one request to /batch/v1 (WordPress 5.6+).
+    // Returns, for each post in order, its id or its error, classified by its status.
+    std::vector<std::variant<int, HttpError>> publish(const std::vector<const PostForm *> &posts)
+    {
+      sp_assert(!posts.empty() && posts.size() <= 25, "A batch holds 1 to 25 posts.");
+      std::cout << "Uploading a batch of " << posts.size() << std::endl;
+      Http h{server + "/?rest_route=/batch/v1"};
+      if(timeout != -1) h.set_timeout(timeout);
+      h.set_header({"Authorization: Basic " + base64_encode(user + ":" + passwd),
+                    "Content-Type: application/json"});
+      h.set_stage(Stage::Post).set_str().post_data(make_batch(posts));
+      h.check_status();
+      auto res = h.response.str();
+      rapidjson::Document json;
+      json.Parse(res.data(), res.size());
+      sp_assert(!json.HasParseError() && json.IsObject() && json.HasMember("responses")
+                && json["responses"].IsArray() && json["responses"].Size() == posts.size(),
+                "Unexpected response: Response code: " + std::to_string(h.response_code)
+                + ", Response: \n" + std::string(res));
+      std::vector<std::variant<int, HttpError>> ret;
+      auto &responses = json["responses"];
+      for (rapidjson::SizeType i = 0; i < responses.Size(); ++i)
+      {
+        auto &r = responses[i];
+        auto status = r.HasMember("status") && r["status"].IsInt() ? r["status"].GetInt() : 0;
+        if (r.HasMember("body") && r["body"].IsObject())
+        {
+          auto &body = r["body"];
+          if (status / 100 == 2 && body.HasMember("id") && body["id"].IsInt())
+          {
+            ret.emplace_back(body["id"].GetInt());
+            continue;
+          }
+          if (body.HasMember("message") && body["message"].IsString())
+          {
+            ret.emplace_back(HttpError("Status " + std::to_string(status) + ": " + body["message"].GetString(),
+                                       classify(CURLE_OK, status)));
+            continue;
+          }
+        }
+        ret.emplace_back(HttpError("Status " + std::to_string(status) + ": Unexpected response.",
+                                   classify(CURLE_OK, status)));
+      }
+      return ret;
     }
   
   private:
+    std::unique_ptr<Http> make_tags_request(size_t page)
+    {
+      auto h = std::make_unique<Http>(server + "/?rest_route=/wp/v2/tags&per_page=100&_fields=id,name&page="
+                                      + std::to_string(page));
+      if(timeout != -1) h->set_timeout(timeout);
+      h->set_header({"Authorization: Basic " + base64_encode(user + ":" + passwd)});
+      h->set_stage(Stage::Tag).set_str().set_compressed().capture_headers();
+      return h;
+    }
+    
+    // Takes pages of tags from next on, one at a time, until total. next and error are
+    // shared by every fetch_tags() on loop, and the first error ends all of them.
+    Task<void> fetch_tags(Loop &loop, size_t &next, size_t total, std::exception_ptr &error)
+    {
+      while (next <= total && !error)
+      {
+        auto h = make_tags_request(next++);
+        try
+        {
+          co_await h->get(loop);
+          add_tags(*h);
+        }
+        catch (...)
+        {
+          error = std::current_exception();
+        }
+      }
+    }
+    
+    void add_tags(Http &h)
+    {
+      h.check_status();
+      auto res = h.response.str();
+      rapidjson::Document json;
+      json.Parse(res.data(), res.size());
+      sp_assert(!json.HasParseError() && json.IsArray(), "Unexpected response: Response: \n" + std::string(res));
+      std::unique_lock l(tags_lock);
+      for (auto it = json.Begin(); it != json.End(); ++it)
+      {
+        if (!it->IsObject() || !it->HasMember("id") || !it->HasMember("name")) continue;
+        if (!(*it)["id"].IsInt() || !(*it)["name"].IsString()) continue;
+        tags_cache[unescape_html((*it)["name"].GetString())] = (*it)["id"].GetInt();
+      }
+    }
+    
+    // WordPress returns term names with HTML entities.
+    static std::string unescape_html(const std::string &str)
+    {
+      static const std::pair<std::string_view, char> entities[] = {
+          {"&amp;", '&'}, {"&lt;", '<'}, {"&gt;", '>'}, {"&quot;", '"'}, {"&#039;", '\''}, {"&#39;", '\''}
+      };
+      std::string ret;
+      ret.reserve(str.size());
+      for (size_t i = 0; i < str.size(); ++i)
+      {
+        bool replaced = false;
+        if (str[i] == '&')
+        {
+          for (auto &[entity, ch]: entities)
+          {
+            if (std::string_view(str).substr(i, entity.size()) == entity)
+            {
+              ret += ch;
+              i += entity.size() - 1;
+              replaced = true;
+              break;
+            }
+          }
+        }
+        if (!replaced) ret += str[i];
+      }
+      return ret;
+    }
+    
+    std::pair<int, std::string> parse_media(Http &h)
+    {
+      h.check_status();
+      auto res = h.response.str();
+      rapidjson::Document json;
+      json.Parse(res.data(), res.size());
+      return {json["id"].GetInt(), json["description"]["rendered"].GetString()};
+    }
+    
+    std::string media_filename(const Post &t, size_t i)
+    {
+      std::string ext = ".";
+      switch (t.get_media()[i].first)
+      {
+        case Post::Type::Image:
+          ext += "jpg";
+          break;
+        case Post::Type::Video:
+          ext += "mp4";
+          break;
+        default:
+          break;
+      }
+      return std::to_string(i) + ext;
+    }
+    
     std::string get_home()
     {
       char const *home = getenv("HOME");
@@ -126,64 +534,194 @@ namespace sp
     std::vector<std::pair<int, std::string>> get_media_content(const Post& post)
     {
       auto paths = cache(post);
-      std::vector<std::pair<int, std::string>> ret;
-      for (auto &p: paths)
+      auto ret = upload_media(paths);
+      remove_cache(paths);
+      return ret;
+    }
+    
+    // All files are uploaded at the same time. The result keeps the order of paths.
+    std::vector<std::pair<int, std::string>> upload_media(const std::vector<std::string> &paths)
+    {
+      std::vector<std::pair<int, std::string>> ret(paths.size());
+      std::vector<std::string> hashes(paths.size());
+      std::vector<std::pair<size_t, std::unique_ptr<Http>>> hs;
+      Multi multi;// declared last, so it releases the handles before they are destroyed
+      for (size_t i = 0; i < paths.size(); ++i)
       {
+        auto &p = paths[i];
+        if (media_index != nullptr)
+        {
+          std::lock_guard l(hashes_lock);
+          if (auto it = cached_hashes.find(p); it != cached_hashes.end())
+            hashes[i] = it->second;
+        }
+        if (!hashes[i].empty())
+        {
+          if (auto hit = media_index->find(hashes[i]))
+          {
+            std::cout << "Reusing media " << hit->first << std::endl;
+            ret[i] = std::move(*hit);
+            continue;
+          }
+        }
         auto path = std::filesystem::path(p);
         auto fn = path.filename().string();
         auto remove_filename = path.remove_filename().string();
         auto timestamp = remove_filename.substr(remove_filename.rfind("/", remove_filename.size() - 2) + 1);
         timestamp.pop_back();
         std::string url = server + "/?rest_route=/wp/v2/media";
-        Http h{url};
-        if(timeout != -1) h.set_timeout(timeout);
-        h.set_header({"Authorization: Basic " + base64_encode(user + ":" + passwd),
+        auto h = std::make_unique<Http>(url);
+        if(timeout != -1) h->set_timeout(timeout);
+        h->set_header({"Authorization: Basic " + base64_encode(user + ":" + passwd),
                       "Content-Disposition: attachment;filename=" + fn});
         std::string title = timestamp + "-" + fn;
-        h.set_str().post(
+        h->set_stage(Stage::MediaUpload).set_str().prepare_post(
             {
                 {Http::FormType::String, "title", title},
                 {Http::FormType::File,   "file",  p}
             }
         );
-        auto &res = *h.response.strp();
-        sp_assert(res.substr(0, 8) != "{\"code\":",
-                  "Unexpected response: Response code: " + std::to_string(h.response_code)
-                  + ", Response: \n" + res);
-        rapidjson::Document json;
-        json.Parse(res.c_str());
-        ret.emplace_back(json["id"].GetInt(), json["description"]["rendered"].GetString());
+        multi.add(*h);
+        hs.emplace_back(i, std::move(h));
+      }
+      multi.perform_all();
+      for (auto &[i, h]: hs)
+      {
+        ret[i] = parse_media(*h);
+        if (!hashes[i].empty())
+          media_index->add(hashes[i], ret[i].first, ret[i].second);
       }
-      std::filesystem::remove_all(std::filesystem::path(paths[0]).remove_filename());
       return ret;
     }
-    std::vector<std::string> cache(const Post& t)
+    
+    // Like get_media_content(), but every media is streamed through a Relay, so it
+    // only touches the disk if the upload falls behind the download.
+    std::vector<std::pair<int, std::string>> relay_media(const Post &t)
     {
-      sp_assert(!t.get_url().empty());
-      auto ts = get_timestamp();
+      auto ts = get_timestamp() + "-" + std::to_string(cache_count++);
       auto dpath = get_home() + "/.sotpider/";
-      if (!std::filesystem::exists(dpath))
-        std::filesystem::create_directory(dpath);
-      std::filesystem::path p{dpath + ts + "/"};
-      std::filesystem::create_directory(p);
-      std::vector<std::string> paths;
-      for (size_t i = 0; i < t.get_url().size(); ++i)
+      std::filesystem::create_directories(dpath);
+      std::vector<std::future<std::pair<int, std::string>>> medias;
+      for (size_t i = 0; i < t.get_media().size(); ++i)
       {
-        std::string ext = ".";
-        switch (t.get_url()[i].first)
+        medias.emplace_back(std::async(std::launch::async, [this, &t, i, &ts, &dpath]
         {
-          case Post::Type::Image:
-            ext += "jpg";
-            break;
-          case Post::Type::Video:
-            ext += "mp4";
-            break;
-          default:
-            break;
-        }
-        paths.emplace_back(p.string() + std::to_string(i) + ext);
+          auto fn = media_filename(t, i);
+          auto memory = Budget::memory().acquire(relay_buffer);
+          Relay relay{relay_buffer, dpath + ts + "-" + fn + ".spill"};
+          Hash64 hash;
+          Http down{t.get_url(i)};
+          if(timeout != -1) down.set_timeout(timeout);
+          down.set_stage(Stage::MediaDownload).set_relay(relay);
+          if (media_index != nullptr) down.set_hash(hash);
+          auto downloading = std::async(std::launch::async, [&down, &relay]
+          {
+            try
+            {
+              down.get();
+              down.check_status();
+              relay.finish(true);
+            }
+            catch (...)
+            {
+              relay.finish(false);
+              throw;
+            }
+          });
+          try
+          {
+            Http up{server + "/?rest_route=/wp/v2/media"};
+            if(timeout != -1) up.set_timeout(timeout);
+            up.set_header({"Authorization: Basic " + base64_encode(user + ":" + passwd),
+                           "Content-Disposition: attachment;filename=" + fn});
+            up.set_stage(Stage::MediaUpload).set_str().prepare_post({{Http::FormType::String, "title", ts + "-" + fn}});
+            up.add_part("file", fn, relay).perform();
+            downloading.get();
+            auto media = parse_media(up);
+            if (media_index != nullptr)
+              media_index->add(hash.hex(), media.first, media.second);
+            return media;
+          }
+          catch (...)
+          {
+            relay.cancel();
+            if (downloading.valid())
+            {
+              downloading.wait();
+              downloading.get();// a failed download is the cause, so it is the one reported
+            }
+            throw;
+          }
+        }));
+      }
+      std::vector<std::pair<int, std::string>> ret;
+      for (auto &m: medias)
+        ret.emplace_back(m.get());
+      return ret;
+    }
+    
+    void remove_cache(const std::vector<std::string> &paths)
+    {
+      if (paths.empty()) return;
+      std::filesystem::remove_all(std::filesystem::path(paths[0]).remove_filename());
+      std::lock_guard l(hashes_lock);
+      for (auto &p: paths)
+        cached_hashes.erase(p);
+    }
+    // Removes what the failed cache() of t left for the next one, once t is given up.
+    void drop_cache(const Post &t)
+    {
+      std::string dir;
+      {
+        std::lock_guard l(partial_lock);
+        auto it = partial.find(t.get_key());
+        if (it == partial.end()) return;
+        dir = std::move(it->second);
+        partial.erase(it);
+      }
+      std::error_code ec;
+      std::filesystem::remove_all(dir, ec);
+    }
+    
+    // Downloads the media of t into a new directory. If it fails, the next cache()
+    // of t goes on in the same directory, where the partial files were left.
+    std::vector<std::string> cache(const Post& t)
+    {
+      sp_assert(!t.get_media().empty());
+      auto key = t.get_key();
+      std::string dir;
+      {
+        std::lock_guard l(partial_lock);
+        if (auto it = partial.find(key); it != partial.end())
+          dir = it->second;
+      }
+      if (dir.empty())
+      {
+        // Several download workers may cache in the same millisecond.
+        auto ts = get_timestamp() + "-" + std::to_string(cache_count++);
+        auto dpath = get_home() + "/.sotpider/";
+        if (!std::filesystem::exists(dpath))
+          std::filesystem::create_directory(dpath);
+        dir = dpath + ts + "/";
+        std::filesystem::create_directory(dir);
+        std::lock_guard l(partial_lock);
+        partial[key] = dir;
+      }
+      std::filesystem::path p{dir};
+      std::vector<std::string> paths;
+      for (size_t i = 0; i < t.get_media().size(); ++i)
+        paths.emplace_back(p.string() + media_filename(t, i));
+      std::vector<std::string> hashes;
+      t.download(download_options, paths, media_index == nullptr ? nullptr : &hashes);
+      {
+        std::lock_guard l(partial_lock);
+        partial.erase(key);
       }
-      t.download(timeout, paths);
+      if (media_index == nullptr)
+        return paths;
+      std::lock_guard l(hashes_lock);
+      for (size_t i = 0; i < paths.size(); ++i)
+        cached_hashes[paths[i]] = hashes[i];
       return paths;
     }
   };
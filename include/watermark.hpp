@@ -0,0 +1,86 @@
+//   Copyright 2023 sotpider - caozhanhao
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+#ifndef SOTPIDER_WATERMARK_HPP
+#define SOTPIDER_WATERMARK_HPP
+#include "error.hpp"
+#include <string>
+#include <map>
+#include <mutex>
+#include <fstream>
+#include <filesystem>
+namespace sp
+{
+  // Post ids are decimal numbers that grow over time, possibly too large for any integer type.
+  bool newer_id(const std::string &a, const std::string &b)
+  {
+    if (a.size() != b.size()) return a.size() > b.size();
+    return a > b;
+  }
+  
+  // The newest post id seen for every search id, kept in a file of
+  // "<search id>\t<post id>" lines. A mark only moves forward once every
+  // post up to it has been uploaded, see Pipeline.
+  class WaterMarks
+  {
+  private:
+    std::string path;
+    std::map<std::string, std::string> marks;
+    std::mutex mtx;
+  public:
+    explicit WaterMarks(std::string path_) : path(std::move(path_))
+    {
+      std::ifstream in(path);
+      std::string line;
+      while (std::getline(in, line))
+      {
+        auto tab = line.find('\t');
+        if (tab == std::string::npos || tab == 0 || tab + 1 == line.size()) continue;
+        marks[line.substr(0, tab)] = line.substr(tab + 1);
+      }
+    }
+    
+    // Empty if nothing has been seen.
+    std::string get(const std::string &id)
+    {
+      std::lock_guard l(mtx);
+      auto it = marks.find(id);
+      return it == marks.end() ? "" : it->second;
+    }
+    
+    void advance(const std::string &id, const std::string &post_id)
+    {
+      std::lock_guard l(mtx);
+      auto &mark = marks[id];
+      if (!mark.empty() && !newer_id(post_id, mark)) return;
+      mark = post_id;
+      save_locked();
+    }
+  
+  private:
+    void save_locked()
+    {
+      auto tmp = path + ".tmp";
+      {
+        std::ofstream out(tmp, std::ios_base::out | std::ios_base::trunc);
+        sp_assert(out.is_open(), "Open file failed.");
+        for (auto &[id, mark]: marks)
+          out << id << '\t' << mark << '\n';
+        out.flush();
+        sp_assert(out.good(), "Writing '" + tmp + "' failed.");
+      }
+      std::filesystem::rename(tmp, path);
+    }
+  };
+}
+#endif
\ No newline at end of file
@@ -0,0 +1,361 @@
+//   Copyright 2023 sotpider - caozhanhao
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+#ifndef SOTPIDER_WRITER_HPP
+#define SOTPIDER_WRITER_HPP
+#include "error.hpp"
+#include <array>
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define SOTPIDER_IO_URING
+#endif
+namespace sp
+{
+  // Writes a stream of chunks to consecutive offsets of a file, copied into blocks of
+  // block_size bytes. A full block is handed to io_uring and the next one fills while
+  // the kernel writes it, so the thread receiving the data does not wait for the disk.
+  // Without io_uring, or if the kernel refuses it, a full block is written with pwrite().
+  // Every FileWriter on a thread shares that thread's ring, so a FileWriter is only
+  // used by the thread that created it.
+  class FileWriter
+  {
+  public:
+    static constexpr std::size_t block_size = 256 * 1024;
+    static constexpr std::size_t alignment = 4096;
+  private:
+    static constexpr unsigned depth = 4;// blocks per file, at most depth - 1 being written
+    struct Block
+    {
+      FileWriter *owner = nullptr;
+      char *data = nullptr;
+      std::size_t used = 0;
+      off_t offset = 0;
+      bool busy = false;
+    };
+    
+    int fd;
+    off_t offset;// where the next byte goes
+    int error;// errno of the first failed write
+    std::array<Block, depth> blocks;
+    Block *current;
+#ifdef SOTPIDER_IO_URING
+    // The io_uring of a thread, set up on its first full block, see ring().
+    // A completion carries its Block, so whichever FileWriter reaps it hands it to the owner.
+    struct Ring
+    {
+      static constexpr unsigned entries = 64;
+      int fd = -1;
+      void *sq = MAP_FAILED;
+      std::size_t sq_size = 0;
+      void *cq = MAP_FAILED;
+      std::size_t cq_size = 0;
+      io_uring_sqe *sqes = static_cast<io_uring_sqe *>(MAP_FAILED);
+      std::size_t sqes_size = 0;
+      io_uring_params params{};
+      unsigned inflight = 0;// submitted and not reaped, of every FileWriter on the thread
+      bool broken = false;// io_uring_enter() failed, nothing more is submitted
+      
+      Ring() = default;
+      
+      Ring(const Ring &) = delete;
+      
+      ~Ring() { close(); }
+      
+      bool open()
+      {
+        auto &p = params;
+        p = {};
+        fd = static_cast<int>(::syscall(__NR_io_uring_setup, entries, &p));
+        if (fd < 0)
+        {
+          fd = -1;
+          unsupported = true;// ENOSYS, or forbidden by a seccomp filter
+          return false;
+        }
+        sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cq_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        if (p.features & IORING_FEAT_SINGLE_MMAP)
+          sq_size = cq_size = std::max(sq_size, cq_size);
+        sq = ::mmap(nullptr, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        if (sq != MAP_FAILED)
+          cq = (p.features & IORING_FEAT_SINGLE_MMAP) ? sq :
+               ::mmap(nullptr, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+        if (cq != MAP_FAILED)
+          sqes = static_cast<io_uring_sqe *>(::mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE,
+                                                    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES));
+        if (sqes == MAP_FAILED)
+        {
+          close();
+          unsupported = true;
+          return false;
+        }
+        return true;
+      }
+      
+      void close()
+      {
+        if (sqes != MAP_FAILED) ::munmap(sqes, sqes_size);
+        if (cq != MAP_FAILED && cq != sq) ::munmap(cq, cq_size);
+        if (sq != MAP_FAILED) ::munmap(sq, sq_size);
+        if (fd != -1) ::close(fd);
+        fd = -1;
+        sq = cq = MAP_FAILED;
+        sqes = static_cast<io_uring_sqe *>(MAP_FAILED);
+      }
+      
+      // Whether another write fits without overflowing the completion queue.
+      [[nodiscard]] bool usable() const { return fd != -1 && !broken && inflight < params.cq_entries; }
+    };
+    unsigned pending;// blocks submitted and not completed yet
+    inline static std::atomic<bool> unsupported = false;// io_uring_setup() failed once, do not retry
+#endif
+  public:
+    FileWriter(int fd_, off_t offset_) : fd(fd_), offset(offset_), error(0), current(nullptr)
+#ifdef SOTPIDER_IO_URING
+    , pending(0)
+#endif
+    {
+      for (auto &b: blocks)
+        b.owner = this;
+    }
+    
+    FileWriter(const FileWriter &) = delete;
+    
+    ~FileWriter()
+    {
+      flush();
+      for (auto &b: blocks)
+        std::free(b.data);
+    }
+    
+    // Reserves the next length bytes on disk, so a large file is laid out in one piece.
+    // The file keeps its size, a .part still ends where the data ends.
+    void preallocate(off_t length)
+    {
+      if (length > 0)
+        ::fallocate(fd, FALLOC_FL_KEEP_SIZE, offset, length);// just a hint where unsupported
+    }
+    
+    // Only before anything has been written.
+    void seek(off_t offset_)
+    {
+      sp_assert(current == nullptr || current->used == 0, "Seek after write.");
+      offset = offset_;
+    }
+    
+    // False once a write has failed.
+    bool write(const char *data, std::size_t size)
+    {
+      while (size != 0 && error == 0)
+      {
+        if (current == nullptr && !acquire()) break;
+        auto n = std::min(size, block_size - current->used);
+        std::memcpy(current->data + current->used, data, n);
+        current->used += n;
+        offset += static_cast<off_t>(n);
+        data += n;
+        size -= n;
+        if (current->used == block_size)
+          submit();
+      }
+      return error == 0;
+    }
+    
+    // Writes out what is buffered and waits for every write. False if one has failed.
+    bool flush()
+    {
+      if (current != nullptr && current->used != 0)
+        submit();
+#ifdef SOTPIDER_IO_URING
+      while (pending != 0)
+        reap(true);
+#endif
+      return error == 0;
+    }
+    
+    [[nodiscard]] int failure() const { return error; }
+  
+  private:
+    bool acquire()
+    {
+      while (error == 0)
+      {
+        for (auto &b: blocks)
+        {
+          if (b.busy) continue;
+          if (b.data == nullptr)
+          {
+            b.data = static_cast<char *>(std::aligned_alloc(alignment, block_size));
+            if (b.data == nullptr)
+            {
+              error = ENOMEM;
+              return false;
+            }
+          }
+          b.used = 0;
+          b.offset = offset;
+          current = &b;
+          return true;
+        }
+#ifdef SOTPIDER_IO_URING
+        reap(true);// every block is being written
+#endif
+      }
+      return false;
+    }
+    
+    void submit()
+    {
+      auto b = current;
+      current = nullptr;
+#ifdef SOTPIDER_IO_URING
+      auto &r = ring();
+      if (!unsupported && (r.fd != -1 || (b->used == block_size && r.open())) && r.usable())
+      {
+        b->busy = true;
+        auto &p = r.params;
+        auto tail = std::atomic_ref(*ring_field(r.sq, p.sq_off.tail));
+        auto t = tail.load(std::memory_order_relaxed);
+        auto index = t & *ring_field(r.sq, p.sq_off.ring_mask);
+        auto &sqe = r.sqes[index];
+        std::memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = IORING_OP_WRITE;
+        sqe.fd = fd;
+        sqe.off = static_cast<__u64>(b->offset);
+        sqe.addr = reinterpret_cast<__u64>(b->data);
+        sqe.len = static_cast<__u32>(b->used);
+        sqe.user_data = reinterpret_cast<__u64>(b);
+        ring_field(r.sq, p.sq_off.array)[index] = index;
+        tail.store(t + 1, std::memory_order_release);
+        ++pending;
+        ++r.inflight;
+        if (::syscall(__NR_io_uring_enter, r.fd, 1, 0, 0, nullptr, 0) < 0)
+        {
+          // nothing was taken, undo and write it ourselves
+          tail.store(t, std::memory_order_release);
+          --pending;
+          --r.inflight;
+          b->busy = false;
+          write_block(*b, 0);
+        }
+        return;
+      }
+#endif
+      write_block(*b, 0);
+    }
+    
+    // Writes the block from its byte done on, with pwrite().
+    void write_block(Block &b, std::size_t done)
+    {
+      while (done < b.used && error == 0)
+      {
+        auto r = ::pwrite(fd, b.data + done, b.used - done, b.offset + static_cast<off_t>(done));
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0)
+          error = r < 0 ? errno : EIO;
+        else
+          done += static_cast<std::size_t>(r);
+      }
+      b.busy = false;
+    }
+
+#ifdef SOTPIDER_IO_URING
+    static Ring &ring()
+    {
+      thread_local Ring r;
+      return r;
+    }
+    
+    static unsigned *ring_field(void *ring, __u32 offset)
+    {
+      return reinterpret_cast<unsigned *>(static_cast<char *>(ring) + offset);
+    }
+    
+    // Takes the completed writes of every FileWriter on the thread, waiting for one if wait.
+    void reap(bool wait)
+    {
+      auto &r = ring();
+      if (r.broken)
+      {
+        abandon();
+        return;
+      }
+      auto &p = r.params;
+      auto head = std::atomic_ref(*ring_field(r.cq, p.cq_off.head));
+      auto tail = std::atomic_ref(*ring_field(r.cq, p.cq_off.tail));
+      auto mask = *ring_field(r.cq, p.cq_off.ring_mask);
+      auto cqes = reinterpret_cast<io_uring_cqe *>(static_cast<char *>(r.cq) + p.cq_off.cqes);
+      auto h = head.load(std::memory_order_relaxed);
+      if (wait && h == tail.load(std::memory_order_acquire))
+      {
+        auto ret = ::syscall(__NR_io_uring_enter, r.fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+        if (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+        {
+          r.broken = true;
+          abandon();
+          return;
+        }
+      }
+      for (; h != tail.load(std::memory_order_acquire); ++h)
+      {
+        auto &cqe = cqes[h & mask];
+        auto b = reinterpret_cast<Block *>(cqe.user_data);
+        --r.inflight;
+        b->owner->complete(*b, cqe.res);
+      }
+      head.store(h, std::memory_order_release);
+    }
+    
+    void complete(Block &b, int res)
+    {
+      --pending;
+      if (res == -EINVAL)
+      {
+        unsupported = true;// a kernel without IORING_OP_WRITE
+        write_block(b, 0);
+      }
+      else if (res < 0)
+      {
+        if (error == 0) error = -res;
+        b.busy = false;
+      }
+      else
+        write_block(b, static_cast<std::size_t>(res));// the rest of a short write
+    }
+    
+    // The ring has failed. The kernel may still write from the busy blocks, so they are
+    // written again with pwrite() and then left alone instead of being reused.
+    void abandon()
+    {
+      for (auto &b: blocks)
+      {
+        if (!b.busy) continue;
+        write_block(b, 0);
+        b.data = nullptr;// not freed, see above
+      }
+      pending = 0;
+    }
+#endif
+  };
+}
+#endif
\ No newline at end of file
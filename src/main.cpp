@@ -15,54 +15,88 @@
 #include "libczh/czh.hpp"
 #include <iostream>
 #include <string>
+#include <thread>
+#include <csignal>
+#include <pthread.h>
 
 int main()
 {
   czh::Czh e("config.czh", czh::InputMode::nonstream);
   auto node = e.parse();
-  size_t id_pos = 0;
-  size_t post_pos =  0;
-  std::vector<sp::Post> posts;
-  int timeout = node["config"]["timeout"].is<czh::value::Null>() ? -1 : node["config"]["timeout"].get<int>();
-  sp::Uploader uploader{node["config"]["to_server"].get<std::string>(),
-                        node["config"]["username"].get<std::string>(),
-                        node["config"]["password"].get<std::string>(),
-                        timeout};
-  sp::PostGetter vg{
-      node["config"]["from_server"].get<std::string>(),
-      node["config"]["download_server"].get<std::string>(),
-      timeout
+  sp::PipelineConfig config;
+  // A negative int would wrap around in the size_t fields.
+  auto count = [&node](const std::string &name)
+  {
+    auto value = node["config"][name].get<int>();
+    sp::sp_assert(value >= 0, "'" + name + "' must not be negative.");
+    return static_cast<std::size_t>(value);
   };
+  config.from_server = node["config"]["from_server"].get<std::string>();
+  config.download_server = node["config"]["download_server"].get<std::string>();
+  config.to_server = node["config"]["to_server"].get<std::string>();
+  config.username = node["config"]["username"].get<std::string>();
+  config.password = node["config"]["password"].get<std::string>();
+  config.timeout = node["config"]["timeout"].is<czh::value::Null>() ? -1 : node["config"]["timeout"].get<int>();
+  config.page_range.first = node["config"]["from_page"].get<int>();
+  config.page_range.second = node["config"]["end_page"].is<czh::value::Null>() ? -1 : node["config"]["end_page"].get<int>();
+  config.fetch_concurrency = count("fetch_concurrency");
+  config.fetch_workers = count("fetch_workers");
+  config.download_workers = count("download_workers");
+  config.upload_workers = count("upload_workers");
+  config.queue_size = count("queue_size");
+  config.spill = node["config"]["spill"].get<std::string>();
+  config.spill_budget = count("spill_budget");
+  config.relay_buffer = count("relay_buffer");
+  config.download_ranges = count("download_ranges");
+  config.range_threshold = node["config"]["range_threshold"].get<int>();
+  config.journal = node["config"]["journal"].get<std::string>();
+  config.tags_cache = node["config"]["tags_cache"].get<std::string>();
+  config.media_index = node["config"]["media_index"].get<std::string>();
+  config.tags_warm = count("tags_warm");
+  config.batch_size = count("batch_size");
+  config.batch_interval = node["config"]["batch_interval"].get<int>();
+  config.incremental = node["config"]["incremental"].get<bool>();
+  config.state = node["config"]["state"].get<std::string>();
+  config.max_attempts = count("max_attempts");
+  config.backoff_base = node["config"]["backoff_base"].get<int>();
+  config.backoff_cap = node["config"]["backoff_cap"].get<int>();
+  config.rate_limit = node["config"]["rate_limit"].get<double>();
+  config.bandwidth_limit = node["config"]["bandwidth_limit"].get<double>();
+  config.max_streams = node["config"]["max_streams"].get<int>();
+  config.metrics = node["config"]["metrics"].get<std::string>();
+  config.metrics_format = node["config"]["metrics_format"].get<std::string>() == "json"
+                          ? sp::Metrics::Format::Json : sp::Metrics::Format::Prometheus;
+  config.metrics_interval = node["config"]["metrics_interval"].get<int>();
+  config.memory_budget = count("memory_budget");
+  config.disk_budget = count("disk_budget");
+  config.progress_interval = node["config"]["progress_interval"].get<int>();
+  config.recrawl_interval = node["config"]["recrawl_interval"].get<int>();
+  config.recrawl_jitter = node["config"]["recrawl_jitter"].get<int>();
+  // In daemon mode, SIGINT and SIGTERM let the posts in flight be uploaded first.
+  // Blocked before any thread is started, so only the sigwait() below receives them.
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  if (config.recrawl_interval > 0)
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+  if (node["config"]["preconnect"].get<bool>())
+    sp::CurlPool::get().preconnect({config.from_server, config.download_server, config.to_server}, config.timeout);
   auto ids = node["config"]["search_id"].get <std::vector<std::string>>();
-  auto fp = node["config"]["from_page"].get<int>();
-  auto ep = node["config"]["end_page"].is<czh::value::Null>() ? -1 : node["config"]["end_page"].get<int>();
-  bool done = false;
-  while(!done)
+  sp::Pipeline pipeline{config};
+  if (config.recrawl_interval <= 0)
   {
-    try
-    {
-      for (;id_pos < ids.size(); ++id_pos)
-      {
-        auto tmp = vg.fetch_video(ids[id_pos], {fp, ep});
-        posts.insert(posts.end(), std::make_move_iterator(tmp.begin()), std::make_move_iterator(tmp.end()));
-      }
-      for (; post_pos < posts.size(); ++post_pos)
-      {
-        posts[post_pos].print();
-        uploader.upload(posts[post_pos]);
-        std::cout << "-------------------------------------------\n";
-      }
-      done = true;
-    }
-    catch (sp::Error &e)
-    {
-      std::cerr << e.get_content() << std::endl;
-    }
-    catch (...)
-    {
-      std::cerr << "Unexpected Error." << std::endl;
-    }
+    pipeline.run(ids);
+    return 0;
   }
+  std::thread waiter([&signals, &pipeline]
+                     {
+                       int sig = 0;
+                       sigwait(&signals, &sig);
+                       std::cout << "Stopping, finishing the posts in flight." << std::endl;
+                       pipeline.stop();
+                     });
+  pipeline.serve(ids);
+  waiter.join();
   return 0;
 }
-
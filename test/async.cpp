@@ -0,0 +1,144 @@
+//   Copyright 2023 sotpider - caozhanhao
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+// Tests of Loop in async.hpp against local mock servers: get and post from coroutines,
+// spawn() and drain(), and transfers the RateLimiter holds back.
+// Exits with 1 on the first failed check.
+#include "async.hpp"
+#include "mock_server.hpp"
+#include "test.hpp"
+#include <iostream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <chrono>
+
+namespace
+{
+  using Clock = std::chrono::steady_clock;
+  using sp::test::check;
+  
+  // Replies with the method, target and body of the request.
+  sp::bench::Reply echo(const sp::bench::Request &req)
+  {
+    return {200, {}, req.method + " " + req.target + "\n" + req.body};
+  }
+  
+  std::unique_ptr<sp::Http> make(const std::string &url)
+  {
+    auto h = std::make_unique<sp::Http>(url);
+    h->set_str();
+    return h;
+  }
+  
+  void test_get_post(sp::Loop &loop, const std::string &url)
+  {
+    auto body = sp::sync_wait([](sp::Loop &loop, const std::string &url) -> sp::Task<std::string>
+                              {
+                                co_await loop.schedule();
+                                std::string ret;
+                                auto h = make(url + "/get");
+                                co_await h->get(loop);
+                                ret += h->response.str();
+                                h = make(url + "/data");
+                                std::string payload = "payload";
+                                co_await h->post_data(loop, payload);
+                                ret += h->response.str();
+                                h = make(url + "/form");
+                                sp::Http::Form form{{sp::Http::FormType::String, "field", "value"}};
+                                co_await h->post(loop, form);
+                                check(h->response_code == 200, "response code of a form post");
+                                ret += h->response.str();
+                                co_return ret;
+                              }(loop, url));
+    check(body.find("GET /get\n") != std::string::npos, "get");
+    check(body.find("POST /data\npayload") != std::string::npos, "post_data");
+    check(body.find("POST /form\n") != std::string::npos && body.find("value") != std::string::npos, "post");
+  }
+  
+  void test_error(sp::Loop &loop)
+  {
+    bool thrown = sp::sync_wait([](sp::Loop &loop) -> sp::Task<bool>
+                                {
+                                  co_await loop.schedule();
+                                  auto h = make("http://127.0.0.1:1/");// nothing listens on port 1
+                                  try
+                                  {
+                                    co_await h->get(loop);
+                                  }
+                                  catch (sp::HttpError &)
+                                  {
+                                    co_return true;
+                                  }
+                                  co_return false;
+                                }(loop));
+    check(thrown, "a failed transfer throws from co_await");
+  }
+  
+  void test_spawn_drain(sp::Loop &loop, const std::string &url)
+  {
+    std::size_t done = 0;// only touched on the loop thread
+    for (int i = 0; i < 50; ++i)
+    {
+      loop.spawn([](sp::Loop &loop, std::string url, std::size_t &done) -> sp::Task<void>
+                 {
+                   auto h = make(url);
+                   co_await h->get(loop);
+                   if (h->response.str().find(url.substr(url.rfind('/'))) != std::string::npos)
+                     ++done;
+                 }(loop, url + "/spawn/" + std::to_string(i), done));
+    }
+    loop.drain();
+    check(done == 50, "every spawned task finished before drain() returned");
+  }
+  
+  // 10 requests at 5 per second, with a burst of 5, take about a second.
+  // The loop keeps serving other origins in the meantime.
+  void test_rate_limit(sp::Loop &loop, const std::string &limited, const std::string &free)
+  {
+    sp::RateLimiter::get().set(sp::origin_of(limited), 5, 0);
+    auto start = Clock::now();
+    Clock::duration limited_time{}, free_time{};
+    for (int i = 0; i < 10; ++i)
+    {
+      loop.spawn([](sp::Loop &loop, std::string url, Clock::time_point start, Clock::duration &t) -> sp::Task<void>
+                 {
+                   auto h = make(url);
+                   co_await h->get(loop);
+                   t = std::max(t, Clock::now() - start);
+                 }(loop, limited + "/" + std::to_string(i), start, limited_time));
+    }
+    loop.spawn([](sp::Loop &loop, std::string url, Clock::time_point start, Clock::duration &t) -> sp::Task<void>
+               {
+                 auto h = make(url);
+                 co_await h->get(loop);
+                 t = Clock::now() - start;
+               }(loop, free + "/free", start, free_time));
+    loop.drain();
+    check(limited_time >= std::chrono::milliseconds(800), "throttled transfers start later");
+    check(free_time < std::chrono::milliseconds(500), "throttled transfers do not block the loop");
+  }
+}
+
+int main()
+{
+  sp::bench::MockServer server(echo, {});
+  sp::bench::MockServer limited(echo, {});
+  sp::Loop loop;
+  test_get_post(loop, server.url());
+  test_error(loop);
+  test_spawn_drain(loop, server.url());
+  test_rate_limit(loop, limited.url(), server.url());
+  std::cout << "async: all passed" << std::endl;
+}
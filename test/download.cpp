@@ -0,0 +1,190 @@
+//   Copyright 2023 sotpider - caozhanhao
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+// Tests of Download in download.hpp against a local mock server: resuming a .part
+// with a Range request, the two kinds of 416, and a file split into ranges.
+// Exits with 1 on the first failed check.
+#include "download.hpp"
+#include "mock_server.hpp"
+#include "test.hpp"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <filesystem>
+#include <algorithm>
+
+namespace
+{
+  using sp::test::check;
+  
+  // Serves one file, honouring "Range: bytes=<begin>-[<end>]", and remembers the ranges asked for.
+  class FileServer
+  {
+  private:
+    std::string file;
+    std::mutex mtx;
+    std::vector<std::string> ranges;
+    sp::bench::MockServer server;
+  public:
+    explicit FileServer(std::string file_)
+        : file(std::move(file_)), server([this](const sp::bench::Request &req) { return reply(req); }, {}) {}
+    
+    std::string url() const { return server.url() + "/file"; }
+    
+    std::vector<std::string> seen()
+    {
+      std::lock_guard l(mtx);
+      return ranges;
+    }
+  
+  private:
+    sp::bench::Reply reply(const sp::bench::Request &req)
+    {
+      auto it = req.headers.find("range");
+      if (it == req.headers.end())
+        return {200, {"Accept-Ranges: bytes"}, file};
+      {
+        std::lock_guard l(mtx);
+        ranges.emplace_back(it->second);
+      }
+      auto spec = it->second.substr(6);// "bytes="
+      auto dash = spec.find('-');
+      auto begin = std::stoull(spec.substr(0, dash));
+      auto end = dash + 1 == spec.size() ? file.size() - 1 : std::stoull(spec.substr(dash + 1));
+      auto size = std::to_string(file.size());
+      if (begin >= file.size())
+        return {416, {"Content-Range: bytes */" + size}, ""};
+      end = std::min<std::size_t>(end, file.size() - 1);
+      return {206, {"Content-Range: bytes " + std::to_string(begin) + "-" + std::to_string(end) + "/" + size},
+              file.substr(begin, end - begin + 1)};
+    }
+  };
+  
+  std::string read(const std::string &path)
+  {
+    std::ifstream in(path, std::ios_base::binary);
+    std::stringstream ss;
+    ss << in.rdbuf();
+    return ss.str();
+  }
+  
+  void write(const std::string &path, const std::string &data)
+  {
+    std::ofstream out(path, std::ios_base::binary | std::ios_base::trunc);
+    out << data;
+  }
+  
+  // One attempt, driven the way Post::download() does. Throws if it failed.
+  void attempt(const std::string &url, const std::string &path, sp::DownloadOptions options = {})
+  {
+    sp::Download d(url, path, options);
+    if (auto h = d.probe())
+    {
+      sp::Multi probes;
+      probes.add(*h);
+      while (!probes.empty())
+        probes.wait();
+      d.probed();
+    }
+    sp::Multi multi;
+    for (auto h: d.start())
+      multi.add(*h);
+    try
+    {
+      while (!multi.empty())
+        for (auto &[h, cret]: multi.wait())
+          d.finished(*h, cret);
+    }
+    catch (...)
+    {
+      d.suspend();
+      throw;
+    }
+    d.commit();
+  }
+  
+  void test_resume(const std::string &path)
+  {
+    std::string file(100000, 'x');
+    for (std::size_t i = 0; i < file.size(); ++i)
+      file[i] = static_cast<char>('a' + i % 26);
+    FileServer server(file);
+    write(path + ".part", file.substr(0, 40000));
+    attempt(server.url(), path);
+    check(server.seen() == std::vector<std::string>{"bytes=40000-"}, "only the missing bytes are asked for");
+    check(read(path) == file, "a resumed file is complete");
+    check(!std::filesystem::exists(path + ".part"), "the .part is moved into place");
+  }
+  
+  void test_complete_part(const std::string &path)
+  {
+    std::string file = "all of it is here already";
+    FileServer server(file);
+    write(path + ".part", file);
+    attempt(server.url(), path);
+    check(server.seen().size() == 1, "a complete .part is still checked with the server");
+    check(read(path) == file, "a 416 for a complete .part finishes the download");
+  }
+  
+  void test_stale_part(const std::string &path)
+  {
+    std::string file = "the file shrank";
+    FileServer server(file);
+    write(path + ".part", file + " since the last attempt");
+    bool thrown = false;
+    try
+    {
+      attempt(server.url(), path);
+    }
+    catch (sp::HttpError &e)
+    {
+      thrown = e.retryable();
+    }
+    check(thrown, "a 416 for a .part longer than the file is a transient error");
+    check(std::filesystem::file_size(path + ".part") == 0, "the stale .part is emptied");
+    check(!std::filesystem::exists(path), "nothing is moved into place");
+    attempt(server.url(), path);
+    check(read(path) == file, "the next attempt starts over");
+  }
+  
+  void test_split(const std::string &path)
+  {
+    std::string file(1000, 'y');
+    for (std::size_t i = 0; i < file.size(); ++i)
+      file[i] = static_cast<char>('0' + i % 10);
+    FileServer server(file);
+    attempt(server.url(), path, {.ranges = 4, .range_threshold = 100});
+    auto seen = server.seen();
+    std::sort(seen.begin(), seen.end());
+    check(seen == std::vector<std::string>{"bytes=0-249", "bytes=250-499", "bytes=500-749", "bytes=750-999"},
+          "a large file is fetched in the given number of ranges");
+    check(read(path) == file, "the ranges are put together in place");
+    check(!std::filesystem::exists(path + ".part.ranges"), "the range state is removed");
+  }
+}
+
+int main()
+{
+  auto dir = sp::test::temp_path("download");
+  std::filesystem::create_directories(dir);
+  test_resume(dir + "/resume");
+  test_complete_part(dir + "/complete");
+  test_stale_part(dir + "/stale");
+  test_split(dir + "/split");
+  std::filesystem::remove_all(dir);
+  std::cout << "download: all passed" << std::endl;
+}
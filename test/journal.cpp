@@ -0,0 +1,78 @@
+//   Copyright 2023 sotpider - caozhanhao
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+// Tests of Journal in journal.hpp: records survive a restart, and a torn last line is dropped.
+#include "journal.hpp"
+#include "test.hpp"
+#include <fstream>
+#include <sstream>
+#include <filesystem>
+
+namespace
+{
+  using sp::test::check;
+  
+  std::string read(const std::string &path)
+  {
+    std::ifstream in(path);
+    std::stringstream ss;
+    ss << in.rdbuf();
+    return ss.str();
+  }
+  
+  void test_reload(const std::string &path)
+  {
+    {
+      sp::Journal journal(path, 2);
+      journal.finish_page("a", 1);
+      journal.finish_post("a_1", 7);
+      journal.finish_page("a", 2);
+      journal.finish_page("a", 2);
+      check(journal.page_done("a", 2), "a finished page is done at once");
+    }
+    check(read(path) == "page a 1\npost a_1 7\npage a 2\n", "every record is written once on destruction");
+    sp::Journal journal(path);
+    check(journal.page_done("a", 1) && journal.page_done("a", 2), "finished pages are loaded");
+    check(!journal.page_done("a", 3) && !journal.page_done("b", 1), "other pages are not done");
+    check(journal.post_done("a_1") && !journal.post_done("a_2"), "finished posts are loaded");
+  }
+  
+  void test_torn(const std::string &path)
+  {
+    {
+      std::ofstream out(path);
+      out << "page a 1\nnonsense\npost a_1 7\npage a 2";// a crash in the middle of the last write
+    }
+    {
+      sp::Journal journal(path);
+      check(journal.page_done("a", 1) && journal.post_done("a_1"), "the intact records are loaded");
+      check(!journal.page_done("a", 2), "a torn record is dropped");
+      journal.finish_page("a", 3);
+    }
+    check(read(path) == "page a 1\nnonsense\npost a_1 7\npage a 3\n",
+          "the torn record is cut off before the next one is written");
+    sp::Journal journal(path);
+    check(journal.page_done("a", 3) && !journal.page_done("a", 2), "a record after a torn one is loaded");
+  }
+}
+
+int main()
+{
+  auto path = sp::test::temp_path("journal");
+  test_reload(path);
+  std::filesystem::remove(path);
+  test_torn(path);
+  std::filesystem::remove(path);
+  std::cout << "journal: all passed" << std::endl;
+}
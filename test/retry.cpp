@@ -0,0 +1,58 @@
+//   Copyright 2023 sotpider - caozhanhao
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+// Tests of retry() in retry.hpp: which failures are tried again, and how often.
+#include "retry.hpp"
+#include "test.hpp"
+#include <chrono>
+#include <stdexcept>
+
+namespace
+{
+  using sp::test::check;
+  
+  const sp::Backoff fast{std::chrono::milliseconds(1), std::chrono::milliseconds(2)};
+  
+  // Runs retry() on a step that throws what fail(attempt) throws until it returns without throwing.
+  template<typename Fail>
+  std::pair<bool, int> run(Fail fail, std::size_t max_attempts = 0)
+  {
+    int calls = 0;
+    bool ok = sp::retry([&] { fail(calls++); }, fast, max_attempts);
+    return {ok, calls};
+  }
+}
+
+int main()
+{
+  auto [ok, calls] = run([](int n) { if (n < 2) throw sp::HttpError("503", sp::Failure::Transient); });
+  check(ok && calls == 3, "a transient HttpError is retried until the step succeeds");
+  
+  std::tie(ok, calls) = run([](int) { throw sp::HttpError("404", sp::Failure::Permanent); });
+  check(!ok && calls == 1, "a permanent HttpError is not retried");
+  
+  std::tie(ok, calls) = run([](int) { throw sp::HttpError("503", sp::Failure::Transient); }, 4);
+  check(!ok && calls == 4, "a transient HttpError is tried max_attempts times");
+  
+  std::tie(ok, calls) = run([](int) { sp::sp_assert(false, "Invalid page."); });
+  check(!ok && calls == 1, "an sp::Error is not retried");
+  
+  std::tie(ok, calls) = run([](int) { throw std::runtime_error("boom"); });
+  check(!ok && calls == 1, "a std::exception is not retried");
+  
+  std::tie(ok, calls) = run([](int) { throw 42; });
+  check(!ok && calls == 1, "an unknown exception is not retried");
+  
+  std::cout << "retry: all passed" << std::endl;
+}
@@ -0,0 +1,60 @@
+//   Copyright 2023 sotpider - caozhanhao
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+// Tests of SpillQueue in spill.hpp: order across memory and file, growing the
+// file, and starting over at its beginning once it is drained.
+#include "spill.hpp"
+#include "test.hpp"
+#include <string>
+
+namespace
+{
+  using sp::test::check;
+  
+  sp::Post make(std::size_t n, std::size_t text_size)
+  {
+    std::string text(text_size, static_cast<char>('a' + n % 26));
+    return {"user", "search", text, {"tag"}, "http://127.0.0.1/download?url=",
+            {{sp::Post::Type::Image, "img" + std::to_string(n)}}, std::to_string(n), n};
+  }
+  
+  // Pushes n posts and pops them all, checking they come out in order and intact.
+  void round(sp::SpillQueue &queue, std::size_t n, std::size_t text_size, const std::string &what)
+  {
+    for (std::size_t i = 0; i < n; ++i)
+      check(queue.push(make(i, text_size)), what + ": push");
+    check(queue.spilled_count() > 0, what + ": posts over the budget are spilled");
+    for (std::size_t i = 0; i < n; ++i)
+    {
+      auto post = queue.pop();
+      check(post.has_value() && post->get_id() == std::to_string(i), what + ": posts come out in order");
+      check(post->get_text() == std::string(text_size, static_cast<char>('a' + i % 26))
+            && post->get_url(0) == "http://127.0.0.1/download?url=img" + std::to_string(i),
+            what + ": a spilled post is read back intact");
+    }
+    check(queue.spilled_count() == 0, what + ": the file is drained");
+  }
+}
+
+int main()
+{
+  sp::SpillQueue queue(1, sp::test::temp_path("spill"), 4096);
+  round(queue, 100, 100, "small");
+  round(queue, 300, 10000, "beyond the initial file size");
+  round(queue, 100, 100, "after starting over");
+  queue.close();
+  check(!queue.pop().has_value(), "a closed and drained queue returns nothing");
+  check(!queue.push(make(0, 1)), "a closed queue takes nothing");
+  std::cout << "spill: all passed" << std::endl;
+}
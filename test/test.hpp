@@ -0,0 +1,40 @@
+//   Copyright 2023 sotpider - caozhanhao
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+#ifndef SOTPIDER_TEST_HPP
+#define SOTPIDER_TEST_HPP
+#include <iostream>
+#include <string>
+#include <cstdlib>
+#include <filesystem>
+#include <unistd.h>
+namespace sp::test
+{
+  // Ends the test with exit code 1 unless ok.
+  void check(bool ok, const std::string &what)
+  {
+    if (ok) return;
+    std::cerr << "FAILED: " << what << std::endl;
+    std::exit(1);
+  }
+  
+  // A path in the temporary directory that no other test run uses. Nothing is created there.
+  std::string temp_path(const std::string &name)
+  {
+    auto path = std::filesystem::temp_directory_path()
+                / ("sotpider_test_" + std::to_string(::getpid()) + "_" + name);
+    std::filesystem::remove_all(path);
+    return path.string();
+  }
+}
+#endif
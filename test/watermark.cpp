@@ -0,0 +1,63 @@
+//   Copyright 2023 sotpider - caozhanhao
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+// Tests of newer_id() and WaterMarks in watermark.hpp.
+#include "watermark.hpp"
+#include "test.hpp"
+#include <fstream>
+#include <filesystem>
+
+namespace
+{
+  using sp::test::check;
+  
+  void test_newer_id()
+  {
+    check(sp::newer_id("10", "9"), "a longer id is newer");
+    check(!sp::newer_id("9", "10"), "a shorter id is older");
+    check(sp::newer_id("124", "123") && !sp::newer_id("123", "124"), "ids of one length compare by digits");
+    check(!sp::newer_id("123", "123"), "an id is not newer than itself");
+    check(sp::newer_id("184467440737095516160", "18446744073709551615"), "ids beyond 64 bits");
+  }
+  
+  void test_marks(const std::string &path)
+  {
+    {
+      sp::WaterMarks marks(path);
+      check(marks.get("a").empty(), "no mark before anything is seen");
+      marks.advance("a", "100");
+      marks.advance("a", "99");
+      check(marks.get("a") == "100", "a mark does not move back");
+      marks.advance("a", "1000");
+      marks.advance("b", "5");
+      check(marks.get("a") == "1000" && marks.get("b") == "5", "a mark moves forward");
+    }
+    {
+      std::ofstream out(path, std::ios_base::app);
+      out << "no tab\n\tempty id\nc\t\n";
+    }
+    sp::WaterMarks marks(path);
+    check(marks.get("a") == "1000" && marks.get("b") == "5", "marks are loaded from the file");
+    check(marks.get("c").empty() && marks.get("no tab").empty() && marks.get("").empty(), "malformed lines are skipped");
+  }
+}
+
+int main()
+{
+  test_newer_id();
+  auto path = sp::test::temp_path("marks");
+  test_marks(path);
+  std::filesystem::remove(path);
+  std::cout << "watermark: all passed" << std::endl;
+}